@@ -3,7 +3,10 @@
 #include "db.h"
 
 #include <chrono>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 // Define our SQLite (well, 4db) reusable wrapper
 class sqlite_reuse : public reuse::reusable
@@ -79,5 +82,42 @@ int wmain(int argc, wchar_t* argv[])
 		}
 	}
 
+	// Time tearing down a pool full of connections against closing them one at a time
+	size_t teardownCount = 1000;
+	{
+		std::vector<std::unique_ptr<sqlite_reuse>> connections;
+		for (size_t c = 1; c <= teardownCount; ++c)
+			connections.push_back(std::make_unique<sqlite_reuse>(db_file_path));
+
+		std::cout << "Serial close: ";
+		auto start = high_resolution_clock::now();
+		connections.clear();
+		auto elapsedMs = std::chrono::duration_cast<milliseconds>(high_resolution_clock::now() - start);
+		std::cout << elapsedMs.count() << "ms" << std::endl;
+	}
+	{
+		reuse::pool<sqlite_reuse>
+			pool
+			(
+				[](const std::wstring& initializer)
+				{
+					return new sqlite_reuse(initializer);
+				},
+				teardownCount
+			);
+		{
+			// Hold them all at once so they all end up in the pool
+			std::deque<reuse::pool<sqlite_reuse>::reuse<sqlite_reuse>> uses;
+			for (size_t c = 1; c <= teardownCount; ++c)
+				uses.emplace_back(pool, db_file_path);
+		}
+
+		std::cout << "Pool shutdown: ";
+		auto start = high_resolution_clock::now();
+		bool closedAll = pool.shutdown(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+		auto elapsedMs = std::chrono::duration_cast<milliseconds>(high_resolution_clock::now() - start);
+		std::cout << elapsedMs.count() << "ms" << (closedAll ? "" : " (some abandoned)") << std::endl;
+	}
+
 	return 0;
 }
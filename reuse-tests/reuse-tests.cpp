@@ -2,6 +2,10 @@
 
 #include "../reuse/reuse.h"
 
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
 #include <thread>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -43,6 +47,204 @@ namespace reuse
 		bool m_cleanInBackground;
 	};
 
+	class dirty_test_class : public reusable
+	{
+	public:
+		dirty_test_class(const std::wstring& initializer, bool cleanInBackground)
+			: reusable(initializer)
+			, m_cleanInBackground(cleanInBackground)
+		{}
+
+		virtual void clean()
+		{
+			data = "";
+			++cleanCount;
+		}
+		virtual bool cleanInBackground() const { return m_cleanInBackground; }
+		virtual bool trackDirty() const { return true; }
+
+		void process()
+		{
+			data = "914";
+			markDirty();
+		}
+
+		std::string data;
+		int cleanCount = 0;
+
+	private:
+		bool m_cleanInBackground;
+	};
+
+	class buffer_test_class : public reusable
+	{
+	public:
+		buffer_test_class(const std::wstring& initializer)
+			: reusable(initializer)
+			, buffer(100)
+		{}
+
+		virtual size_t footprint() const { return buffer.size(); }
+
+		virtual void hibernate()
+		{
+			if (hibernateFails)
+				throw std::runtime_error("hibernate failed");
+			buffer.clear();
+			buffer.shrink_to_fit();
+		}
+		virtual void wake()
+		{
+			if (wakeFails)
+				throw std::runtime_error("wake failed");
+			buffer.resize(100);
+		}
+
+		std::vector<char> buffer;
+		bool hibernateFails = false;
+		bool wakeFails = false;
+	};
+
+	class flaky_test_class : public reusable
+	{
+	public:
+		flaky_test_class(const std::wstring& initializer)
+			: reusable(initializer)
+		{}
+
+		virtual void clean()
+		{
+			if (cleanFails)
+				throw std::runtime_error("clean failed");
+		}
+
+		virtual bool validate() { return !broken; }
+
+		bool cleanFails = false;
+		bool broken = false;
+	};
+
+	class rebind_test_class : public reusable
+	{
+	public:
+		rebind_test_class(const std::wstring& initializer)
+			: reusable(initializer)
+		{}
+
+		virtual bool reinitialize(const std::wstring& initializer)
+		{
+			if (initializer == L"missing")
+				throw std::runtime_error("cannot reopen");
+			return initializer != L"stubborn";
+		}
+	};
+
+	std::atomic<int> prototype_test_class_count = 0;
+
+	class prototype_test_class : public reusable
+	{
+	public:
+		prototype_test_class(const std::wstring& initializer, int loaded)
+			: reusable(initializer)
+			, loaded(loaded)
+		{
+			prototype_test_class_count.fetch_add(1);
+		}
+
+		~prototype_test_class()
+		{
+			prototype_test_class_count.fetch_add(-1);
+		}
+
+		virtual reusable* clone() const
+		{
+			return new prototype_test_class(initializer(), loaded);
+		}
+
+		virtual size_t footprint() const { return 10; }
+
+		int loaded;
+	};
+
+	class shard_test_class : public basic_reusable<int>
+	{
+	public:
+		shard_test_class(int shard)
+			: basic_reusable<int>(shard)
+		{}
+	};
+
+	class narrow_test_class : public basic_reusable<std::string>
+	{
+	public:
+		narrow_test_class(const std::string& name)
+			: basic_reusable<std::string>(name)
+		{}
+	};
+
+	struct narrow_hash
+	{
+		typedef void is_transparent;
+
+		size_t operator()(std::string_view str) const
+		{
+			return std::hash<std::string_view>()(str);
+		}
+	};
+
+	enum class role { reader, writer, admin, count };
+
+	template <>
+	struct enumerated_keys<role> : enum_keys<role, role::count> {};
+
+	class role_test_class : public basic_reusable<role>
+	{
+	public:
+		role_test_class(role r)
+			: basic_reusable<role>(r)
+		{}
+	};
+
+	class manual_executor : public executor
+	{
+	public:
+		virtual void post(std::function<void()>&& job)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_jobs.push_back(std::move(job));
+		}
+
+		size_t run()
+		{
+			std::vector<std::function<void()>> jobs;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				jobs.swap(m_jobs);
+			}
+			for (auto& job : jobs)
+				job();
+			return jobs.size();
+		}
+
+		bool runOne()
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (m_jobs.empty())
+					return false;
+				job = std::move(m_jobs.front());
+				m_jobs.erase(m_jobs.begin());
+			}
+			job();
+			return true;
+		}
+
+	private:
+		std::vector<std::function<void()>> m_jobs;
+		std::mutex m_mutex;
+	};
+
 	TEST_CLASS(reusetests)
 	{
 	public:
@@ -85,7 +287,7 @@ namespace reuse
 						Assert::AreEqual(std::string("914"), obj.data);
 					}
 					if (should_clean_in_bg) // wait for cleanup
-						std::this_thread::sleep_for(1s);
+						pool.drain();
 
 					// See that the object is clean in the pool, ready for reuse
 					Assert::AreEqual(std::wstring(L"init"), p->initializer());
@@ -93,5 +295,1217 @@ namespace reuse
 				}
 			}
 		}
+
+		TEST_METHOD(TestDirtyTracking)
+		{
+			std::vector<bool> should_clean_in_bgs{ true, false };
+			for (bool should_clean_in_bg : should_clean_in_bgs)
+			{
+				pool<dirty_test_class>
+					pool
+					(
+						[&](const std::wstring& initializer)
+						{
+							return new dirty_test_class(initializer, should_clean_in_bg);
+						}
+				);
+
+				// Look at the object without changing it, and it goes right back on the shelf
+				dirty_test_class* p = nullptr;
+				{
+					auto use = pool.use(L"init");
+					p = &use.get();
+					Assert::IsFalse(p->needsClean());
+				}
+				Assert::AreEqual(0, p->cleanCount);
+				{
+					auto use = pool.use(L"init");
+					Assert::IsTrue(p == &use.get());
+					Assert::AreEqual(0, p->cleanCount);
+
+					// Change the object, and it gets cleaned
+					use.get().process();
+					Assert::IsTrue(p->needsClean());
+				}
+				if (should_clean_in_bg) // wait for cleanup
+					pool.drain();
+
+				Assert::AreEqual(1, p->cleanCount);
+				Assert::AreEqual(std::string(), p->data);
+				Assert::IsFalse(p->needsClean());
+			}
+		}
+
+		TEST_METHOD(TestOverflow)
+		{
+			// With no room in the cleaning queue, background cleaned objects overflow
+			std::vector<overflow> policies{ overflow::drop, overflow::block, overflow::clean_inline };
+			for (overflow policy : policies)
+			{
+				pool<test_class>
+					pool
+					(
+						[&](const std::wstring& initializer)
+						{
+							return new test_class(initializer, true);
+						},
+						1000U,
+						0U,
+						policy
+					);
+
+				test_class* p = nullptr;
+				{
+					auto use = pool.use(L"init");
+					p = &use.get();
+					p->process();
+				}
+
+				pool_stats stats = pool.stats();
+				if (policy == overflow::clean_inline)
+				{
+					// Cleaned on the way back in and ready to go
+					Assert::AreEqual(size_t(0), stats.cleanQueueDrops);
+					Assert::AreEqual(size_t(1), stats.inventory);
+					Assert::AreEqual(std::string(), p->data);
+				}
+				else
+				{
+					Assert::AreEqual(size_t(1), stats.cleanQueueDrops);
+					Assert::AreEqual(size_t(0), stats.inventory);
+				}
+			}
+		}
+
+		TEST_METHOD(TestInvalidate)
+		{
+			std::vector<bool> should_clean_in_bgs{ true, false };
+			for (bool should_clean_in_bg : should_clean_in_bgs)
+			{
+				pool<test_class>
+					pool
+					(
+						[&](const std::wstring& initializer)
+						{
+							return new test_class(initializer, should_clean_in_bg);
+						}
+				);
+
+				// Stock the shelves, then invalidate while one object is out
+				test_class* idle = nullptr;
+				{
+					auto use = pool.use(L"init");
+					idle = &use.get();
+				}
+				if (should_clean_in_bg) // wait for cleanup
+					pool.drain();
+				Assert::AreEqual(size_t(1), pool.stats().inventory);
+
+				{
+					auto use = pool.use(L"init");
+					Assert::IsTrue(idle == &use.get());
+					{
+						auto other = pool.use(L"other");
+					}
+					pool.invalidate(L"init");
+				}
+				if (should_clean_in_bg) // wait for cleanup
+					pool.drain();
+
+				// The object that was out did not make it back onto the shelves
+				// but the other initializer's object is untouched
+				Assert::AreEqual(size_t(1), pool.stats().inventory);
+
+				// Invalidating clears idle objects right off the shelves
+				pool.invalidate(L"other");
+				Assert::AreEqual(size_t(0), pool.stats().inventory);
+			}
+		}
+
+		TEST_METHOD(TestInvalidateDuringConstruction)
+		{
+			// The constructor reads the file that is about to be swapped out
+			std::atomic<int> file = 1;
+			std::promise<void> constructing;
+			std::promise<void> swapped;
+			std::shared_future<void> swappedFuture = swapped.get_future().share();
+			std::atomic<bool> first = true;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						auto t = new test_class(initializer, false);
+						t->data = std::to_string(file.load());
+						if (first.exchange(false))
+						{
+							constructing.set_value();
+							swappedFuture.wait();
+						}
+						return t;
+					}
+				);
+
+			std::string firstData;
+			std::thread user([&]()
+			{
+				auto use = pool.use(L"db");
+				firstData = use.get().data;
+			});
+
+			// Swap the file and invalidate while the object for the old file is being constructed
+			constructing.get_future().wait();
+			file = 2;
+			pool.invalidate(L"db");
+			swapped.set_value();
+			user.join();
+			pool.drain();
+			Assert::AreEqual(std::string("1"), firstData);
+
+			// The object for the old file is not handed out again
+			auto use = pool.use(L"db");
+			Assert::AreEqual(std::string("2"), use.get().data);
+		}
+
+		TEST_METHOD(TestSharedCleaner)
+		{
+			// Lots of pools, all cleaning in the background on the same threads
+			std::vector<std::unique_ptr<pool<test_class>>> pools;
+			std::vector<test_class*> ps;
+			for (int p = 0; p < 40; ++p)
+			{
+				pools.emplace_back
+				(
+					std::make_unique<pool<test_class>>
+					(
+						[&](const std::wstring& initializer)
+						{
+							return new test_class(initializer, true);
+						}
+					)
+				);
+
+				auto use = pools.back()->use(L"init");
+				use.get().process();
+				ps.push_back(&use.get());
+			}
+
+			// wait for cleanup
+			for (auto& p : pools)
+				p->drain();
+
+			for (int p = 0; p < 40; ++p)
+			{
+				Assert::AreEqual(size_t(1), pools[p]->stats().inventory);
+				Assert::AreEqual(std::string(), ps[p]->data);
+			}
+
+			// The thread count can change while cleaning is going
+			size_t threadCount = cleaner::threadCount();
+			cleaner::setThreadCount(threadCount + 2);
+			Assert::AreEqual(threadCount + 2, cleaner::threadCount());
+			cleaner::setThreadCount(1);
+			{
+				auto use = pools.front()->use(L"init");
+				use.get().process();
+				ps.front() = &use.get();
+			}
+			Assert::IsTrue(pools.front()->drain_for(10s));
+			Assert::AreEqual(std::string(), ps.front()->data);
+			cleaner::setThreadCount(threadCount);
+		}
+
+		TEST_METHOD(TestExecutor)
+		{
+			// Background cleaning happens when and where the executor says
+			manual_executor executor;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, true);
+					},
+					1000U,
+					1000U,
+					overflow::drop,
+					executor
+				);
+
+			test_class* p = nullptr;
+			{
+				auto use = pool.use(L"init");
+				p = &use.get();
+				p->process();
+			}
+			Assert::AreEqual(size_t(1), pool.stats().toClean);
+			Assert::AreEqual(size_t(0), pool.stats().inventory);
+
+			Assert::AreEqual(size_t(1), executor.run());
+			Assert::AreEqual(size_t(0), pool.stats().toClean);
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			Assert::AreEqual(std::string(), p->data);
+		}
+
+		TEST_METHOD(TestCleanPriority)
+		{
+			// Background cleaning goes to the bucket that has been missing the most
+			manual_executor executor;
+			int constructions = 0;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						++constructions;
+						return new test_class(initializer, true);
+					},
+					1000U,
+					1000U,
+					overflow::drop,
+					executor
+				);
+
+			// The hot bucket misses three times, then the idle bucket once,
+			// and the idle bucket's object is the last one put back
+			{
+				auto hot1 = pool.use(L"hot");
+				auto hot2 = pool.use(L"hot");
+				auto hot3 = pool.use(L"hot");
+			}
+			{
+				auto idle = pool.use(L"idle");
+			}
+			Assert::AreEqual(4, constructions);
+			Assert::AreEqual(size_t(4), pool.stats().toClean);
+
+			// One clean goes to the hot bucket
+			Assert::IsTrue(executor.runOne());
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			{
+				auto hot = pool.use(L"hot");
+			}
+			Assert::AreEqual(4, constructions);
+
+			executor.run();
+			executor.run();
+			Assert::AreEqual(size_t(0), pool.stats().toClean);
+		}
+
+		TEST_METHOD(TestByteBudget)
+		{
+			manual_executor executor;
+			auto constructor = [](const std::wstring& initializer) { return new buffer_test_class(initializer); };
+			pool<buffer_test_class> pool(constructor, 1000U, 1000U, overflow::drop, executor);
+
+			// Room for two 100 byte objects
+			pool.setMaxBytes(250);
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				auto use3 = pool.use(L"b");
+			}
+			executor.run();
+
+			pool_stats stats = pool.stats();
+			Assert::AreEqual(size_t(2), stats.inventory);
+			Assert::AreEqual(size_t(200), stats.bytes);
+			Assert::AreEqual(size_t(1), stats.budgetDrops);
+
+			// Now limit memory across the process
+			registry::shared().setMaxBytes(registry::shared().bytes() - 100);
+			executor.run();
+			registry::shared().setMaxBytes(0);
+
+			stats = pool.stats();
+			Assert::AreEqual(size_t(1), stats.inventory);
+			Assert::AreEqual(size_t(100), stats.bytes);
+			Assert::AreEqual(size_t(2), stats.budgetDrops);
+		}
+
+		TEST_METHOD(TestCostAwareRetention)
+		{
+			// Room for one object, and "slow" objects take a while to construct
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						if (initializer == L"slow")
+							std::this_thread::sleep_for(20ms);
+						return new test_class(initializer, false);
+					},
+					1U
+				);
+
+			test_class* slow = nullptr;
+			{
+				// The slow one goes back last
+				auto useSlow = pool.use(L"slow");
+				auto useFast = pool.use(L"fast");
+				slow = &useSlow.get();
+			}
+
+			// The slow object pushed out the fast one
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			Assert::AreEqual(size_t(1), pool.stats().inventoryDrops);
+			{
+				auto useSlow = pool.use(L"slow");
+				Assert::IsTrue(slow == &useSlow.get());
+			}
+
+			// The fast object does not push out the slow one
+			{
+				auto useFast = pool.use(L"fast");
+			}
+			Assert::AreEqual(size_t(2), pool.stats().inventoryDrops);
+			{
+				auto useSlow = pool.use(L"slow");
+				Assert::IsTrue(slow == &useSlow.get());
+			}
+		}
+
+		TEST_METHOD(TestHibernate)
+		{
+			manual_executor executor;
+			auto constructor = [](const std::wstring& initializer) { return new buffer_test_class(initializer); };
+			pool<buffer_test_class> pool(constructor, 1000U, 1000U, overflow::drop, executor);
+			pool.setHibernateAfter(1ms);
+
+			buffer_test_class* p = nullptr;
+			{
+				auto use = pool.use(L"init");
+				p = &use.get();
+			}
+			Assert::AreEqual(size_t(100), pool.stats().bytes);
+
+			// Once the object has sat idle, a sweep hibernates it
+			std::this_thread::sleep_for(5ms);
+			pool.maintain();
+			while (executor.run() > 0);
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			Assert::AreEqual(size_t(0), pool.stats().bytes);
+			Assert::AreEqual(size_t(0), p->buffer.size());
+
+			// The same object comes back, woken up
+			{
+				auto use = pool.use(L"init");
+				Assert::IsTrue(p == &use.get());
+				Assert::AreEqual(size_t(100), p->buffer.size());
+			}
+
+			// Trimming for memory takes awake objects, not hibernated ones that hold nothing
+			{
+				auto use1 = pool.use(L"init");
+				auto use2 = pool.use(L"init");
+				auto use3 = pool.use(L"init");
+			}
+			std::this_thread::sleep_for(5ms);
+			pool.maintain();
+			while (executor.run() > 0);
+			{
+				auto use = pool.use(L"init");
+			}
+			pool.setMaxBytes(50);
+			while (executor.run() > 0);
+			pool.setMaxBytes(0);
+			Assert::AreEqual(size_t(1), pool.stats().budgetDrops);
+			Assert::AreEqual(size_t(2), pool.stats().inventory);
+			Assert::AreEqual(size_t(0), pool.stats().bytes);
+
+			// Objects that fail to hibernate or wake up are discarded
+			{
+				auto use1 = pool.use(L"init");
+				auto use2 = pool.use(L"init");
+				use1.get().hibernateFails = true;
+				use2.get().wakeFails = true;
+			}
+			std::this_thread::sleep_for(5ms);
+			pool.maintain();
+			while (executor.run() > 0);
+			Assert::AreEqual(size_t(1), pool.stats().rejected);
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			{
+				auto use = pool.use(L"init");
+				Assert::IsFalse(use.get().wakeFails);
+			}
+			Assert::AreEqual(size_t(2), pool.stats().rejected);
+
+			pool.setHibernateAfter(0ms);
+			while (executor.run() > 0);
+		}
+
+		TEST_METHOD(TestMaxUses)
+		{
+			manual_executor executor;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, false);
+					},
+					1000U,
+					1000U,
+					overflow::drop,
+					executor
+				);
+			pool.setMaxUses(2);
+
+			test_class* p = nullptr;
+			for (int use = 1; use <= 2; ++use)
+			{
+				auto reuse = pool.use(L"init");
+				if (p == nullptr)
+					p = &reuse.get();
+				Assert::IsTrue(p == &reuse.get());
+			}
+
+			// The worn out object is retired and a replacement built in the background
+			Assert::AreEqual(size_t(1), pool.stats().wornOut);
+			Assert::AreEqual(size_t(0), pool.stats().inventory);
+			executor.run();
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+		}
+
+		TEST_METHOD(TestMaxAge)
+		{
+			manual_executor executor;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, false);
+					},
+					1000U,
+					1000U,
+					overflow::drop,
+					executor
+				);
+			pool.setMaxAge(10ms);
+			{
+				auto use = pool.use(L"init");
+			}
+
+			// Once the object has aged, a sweep retires it and constructs a replacement
+			std::this_thread::sleep_for(20ms);
+			pool.maintain();
+			while (executor.run() > 0);
+			Assert::IsTrue(pool.stats().wornOut >= 1);
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+
+			// A shelf too big to check in one sweep gets checked over a few sweeps
+			{
+				std::vector<decltype(pool.use())> uses;
+				for (int i = 0; i < 200; ++i)
+					uses.push_back(pool.use(L"bulk"));
+			}
+			size_t wornOut = pool.stats().wornOut;
+			std::this_thread::sleep_for(20ms);
+			pool.maintain();
+			while (executor.run() > 0);
+			Assert::IsTrue(pool.stats().wornOut < wornOut + 200);
+			for (int sweep = 1; sweep < 4; ++sweep)
+			{
+				pool.maintain();
+				while (executor.run() > 0);
+			}
+			Assert::IsTrue(pool.stats().wornOut >= wornOut + 200);
+
+			pool.setMaxAge(0ms);
+			while (executor.run() > 0);
+		}
+
+		TEST_METHOD(TestValidate)
+		{
+			pool<flaky_test_class> pool([](const std::wstring& initializer) { return new flaky_test_class(initializer); });
+
+			// Objects that fail to clean don't make it back to the shelves
+			{
+				auto use = pool.use(L"init");
+				use.get().cleanFails = true;
+			}
+			Assert::AreEqual(size_t(1), pool.stats().rejected);
+			Assert::AreEqual(size_t(0), pool.stats().inventory);
+
+			// Objects that go bad on the shelf don't get handed out
+			pool.setValidateInterval(1ms);
+			flaky_test_class* p = nullptr;
+			{
+				auto use = pool.use(L"init");
+				p = &use.get();
+			}
+			p->broken = true;
+			std::this_thread::sleep_for(10ms);
+			{
+				auto use = pool.use(L"init");
+				Assert::IsFalse(use.get().broken);
+			}
+			Assert::AreEqual(size_t(2), pool.stats().rejected);
+
+			// The rejected object never counted as out, so the peak is the one object handed out
+			pool.setAdaptiveSizing(0ms, 0.0);
+			Assert::AreEqual(size_t(1), pool.recommendedSizing().maxInventory);
+		}
+
+		TEST_METHOD(TestSingleFlight)
+		{
+			std::atomic<int> constructing = 0;
+			std::atomic<int> mostConstructing = 0;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						int now = constructing.fetch_add(1) + 1;
+						int most = mostConstructing.load();
+						while (now > most && !mostConstructing.compare_exchange_weak(most, now));
+						std::this_thread::sleep_for(20ms);
+						constructing.fetch_add(-1);
+						return new test_class(initializer, false);
+					}
+				);
+			pool.setMaxConstructing(1);
+
+			// A herd of misses only ever has one construction going
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 8; ++t)
+				threads.emplace_back([&]() { auto use = pool.use(L"init"); });
+			for (auto& thread : threads)
+				thread.join();
+			Assert::AreEqual(1, mostConstructing.load());
+
+			// Constructions are spaced out by the rate limit
+			pool.setMaxConstructing(0);
+			pool.setConstructionRate(20.0);
+			auto start = std::chrono::steady_clock::now();
+			{
+				auto use1 = pool.use(L"rated");
+				auto use2 = pool.use(L"rated");
+				auto use3 = pool.use(L"rated");
+			}
+			Assert::IsTrue(std::chrono::steady_clock::now() - start >= 100ms);
+
+			// Background replacements skip a turn rather than sleeping on the executor
+			pool.setConstructionRate(0.5);
+			pool.setMaxUses(1);
+			{
+				auto use = pool.use(L"worn");
+			}
+			Assert::IsTrue(pool.drain_for(500ms));
+			Assert::AreEqual(size_t(1), pool.stats().wornOut);
+		}
+
+		TEST_METHOD(TestHedging)
+		{
+			std::atomic<int> constructing = 0;
+			std::atomic<int> mostConstructing = 0;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						int now = constructing.fetch_add(1) + 1;
+						int most = mostConstructing.load();
+						while (now > most && !mostConstructing.compare_exchange_weak(most, now));
+						std::this_thread::sleep_for(200ms);
+						constructing.fetch_add(-1);
+						return new test_class(initializer, false);
+					}
+				);
+			pool.setHedging(true);
+
+			// Objects come back quicker than they get constructed
+			{
+				auto use1 = pool.use(L"init");
+				auto use2 = pool.use(L"init");
+			}
+
+			// With both objects out, a miss waits for one to come back instead of constructing
+			test_class* returned = nullptr;
+			std::atomic<bool> using1 = false;
+			std::thread returner
+			(
+				[&]()
+				{
+					auto use1 = pool.use(L"init");
+					returned = &use1.get();
+					using1 = true;
+					std::this_thread::sleep_for(10ms);
+				}
+			);
+			while (!using1)
+				std::this_thread::yield();
+			auto use2 = pool.use(L"init");
+			{
+				auto use3 = pool.use(L"init");
+				Assert::IsTrue(returned == &use3.get());
+			}
+			returner.join();
+			Assert::AreEqual(size_t(1), pool.stats().hedges);
+
+			// Hedged constructions take construction slots like any other
+			pool.drain();
+			mostConstructing = 0;
+			pool.setMaxConstructing(1);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 8; ++t)
+			{
+				threads.emplace_back
+				(
+					[&]()
+					{
+						auto use = pool.use(L"init");
+						std::this_thread::sleep_for(300ms);
+					}
+				);
+			}
+			for (auto& thread : threads)
+				thread.join();
+			pool.drain();
+			Assert::AreEqual(1, mostConstructing.load());
+		}
+
+		TEST_METHOD(TestCircuitBreaker)
+		{
+			int constructions = 0;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer) -> test_class*
+					{
+						++constructions;
+						throw std::runtime_error("cannot open");
+					}
+				);
+			pool.setCircuitBreaker(2, 100ms);
+
+			// After two failures the constructor is left alone
+			for (int attempt = 1; attempt <= 5; ++attempt)
+				Assert::ExpectException<std::runtime_error>([&]() { pool.use(L"bad"); });
+			Assert::AreEqual(2, constructions);
+			Assert::AreEqual(size_t(3), pool.stats().fastFails);
+
+			// After the backoff one call gets through to try again
+			std::this_thread::sleep_for(150ms);
+			Assert::ExpectException<std::runtime_error>([&]() { pool.use(L"bad"); });
+			Assert::ExpectException<std::runtime_error>([&]() { pool.use(L"bad"); });
+			Assert::AreEqual(3, constructions);
+		}
+
+		TEST_METHOD(TestReinitialize)
+		{
+			int constructions = 0;
+			pool<rebind_test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						++constructions;
+						return new rebind_test_class(initializer);
+					}
+				);
+			pool.setReinitialize(true);
+
+			// Stock up on "a" objects
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+			}
+			Assert::AreEqual(2, constructions);
+
+			// A "b" miss takes one of the spare "a" objects
+			{
+				auto use = pool.use(L"b");
+				Assert::AreEqual(std::wstring(L"b"), use.get().initializer());
+			}
+			Assert::AreEqual(2, constructions);
+			Assert::AreEqual(size_t(1), pool.stats().reinitialized);
+
+			// An object that won't rebind stays put, and the miss constructs
+			{
+				auto use1 = pool.use(L"b");
+				auto use2 = pool.use(L"b");
+			}
+			{
+				auto use = pool.use(L"stubborn");
+			}
+			Assert::AreEqual(4, constructions);
+			Assert::AreEqual(size_t(1), pool.stats().reinitialized);
+			Assert::AreEqual(size_t(4), pool.stats().inventory);
+
+			// A failing initializer trips its circuit breaker and stops taking other buckets' objects
+			reuse::pool<rebind_test_class>
+				failing
+				(
+					[&](const std::wstring& initializer) -> rebind_test_class*
+					{
+						if (initializer == L"missing")
+							throw std::runtime_error("cannot open");
+						return new rebind_test_class(initializer);
+					}
+				);
+			failing.setReinitialize(true);
+			failing.setCircuitBreaker(1, 1h);
+			{
+				std::vector<decltype(failing.use())> uses;
+				for (int i = 0; i < 10; ++i)
+					uses.push_back(failing.use(L"good"));
+			}
+			for (int attempt = 1; attempt <= 8; ++attempt)
+				Assert::ExpectException<std::runtime_error>([&]() { failing.use(L"missing"); });
+			Assert::AreEqual(size_t(1), failing.stats().rejected);
+			Assert::AreEqual(size_t(8), failing.stats().fastFails);
+			Assert::AreEqual(size_t(9), failing.stats().inventory);
+		}
+
+		TEST_METHOD(TestPrototyping)
+		{
+			int constructions = 0;
+			pool<prototype_test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new prototype_test_class(initializer, ++constructions);
+					}
+				);
+			pool.setPrototyping(true);
+
+			// The first miss constructs, the rest clone
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				auto use3 = pool.use(L"a");
+				Assert::AreEqual(1, use1.get().loaded);
+				Assert::AreEqual(1, use2.get().loaded);
+				Assert::AreEqual(1, use3.get().loaded);
+			}
+			Assert::AreEqual(1, constructions);
+
+			// Each initializer gets its own prototype
+			{
+				auto use1 = pool.use(L"b");
+				auto use2 = pool.use(L"b");
+				Assert::AreEqual(2, use2.get().loaded);
+			}
+			Assert::AreEqual(2, constructions);
+
+			// Invalidation discards the prototype
+			pool.invalidate(L"a");
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				Assert::AreEqual(3, use2.get().loaded);
+			}
+			Assert::AreEqual(3, constructions);
+
+			// Prototypes count toward the pool's bytes, two objects and a prototype for each initializer
+			Assert::AreEqual(size_t(60), pool.stats().bytes);
+
+			// Shutting down lets go of the prototypes along with the objects
+			pool.shutdown();
+			Assert::AreEqual(size_t(0), pool.stats().bytes);
+			Assert::AreEqual(0, prototype_test_class_count.load());
+		}
+
+		TEST_METHOD(TestAdaptiveSizing)
+		{
+			manual_executor executor;
+			pool<test_class>
+				pool
+				(
+					[](const std::wstring& initializer)
+					{
+						return new test_class(initializer, false);
+					},
+					1000U,
+					1000U,
+					overflow::drop,
+					executor
+				);
+
+			// Four out at once is the peak
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				auto use3 = pool.use(L"a");
+				auto use4 = pool.use(L"a");
+			}
+			Assert::AreEqual(size_t(4), pool.stats().inventory);
+			pool.setAdaptiveSizing(1ms, 0.5);
+			Assert::AreEqual(size_t(6), pool.recommendedSizing().maxInventory);
+			Assert::AreEqual(size_t(1), pool.recommendedSizing().maxToClean);
+
+			// Once the peak has aged out of both windows, inventory is trimmed to fit
+			// The first sweep starts a window, and each after it ends one
+			for (int sweep = 0; sweep < 4; ++sweep)
+			{
+				if (sweep > 0)
+					std::this_thread::sleep_for(5ms);
+				pool.maintain();
+				while (executor.run() > 0);
+			}
+			Assert::AreEqual(size_t(1), pool.recommendedSizing().maxInventory);
+			Assert::AreEqual(size_t(1), pool.stats().inventory);
+			Assert::AreEqual(size_t(3), pool.stats().inventoryDrops);
+			pool.setAdaptiveSizing(0ms);
+			while (executor.run() > 0);
+
+			// A burst that overflows the cleaning queue counts toward the peak,
+			// so the queue limit can grow back to fit it
+			{
+				reuse::pool<test_class>
+					bursty
+					(
+						[](const std::wstring& initializer)
+						{
+							return new test_class(initializer, true);
+						},
+						1000U,
+						1U,
+						overflow::drop,
+						executor
+					);
+				bursty.setAdaptiveSizing(1h, 0.0);
+				{
+					std::vector<decltype(bursty.use())> uses;
+					for (int i = 0; i < 10; ++i)
+						uses.push_back(bursty.use(L"b"));
+				}
+				size_t drops = bursty.stats().cleanQueueDrops;
+				size_t recommended = bursty.recommendedSizing().maxToClean;
+				while (executor.run() > 0);
+				Assert::AreEqual(size_t(9), drops);
+				Assert::AreEqual(size_t(10), recommended);
+			}
+		}
+
+		TEST_METHOD(TestReconfigure)
+		{
+			manual_executor executor;
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, true);
+					},
+					8,
+					1,
+					overflow::drop,
+					executor
+				);
+
+			// Fill up the shelves
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				auto use3 = pool.use(L"b");
+				auto use4 = pool.use(L"b");
+			}
+			Assert::AreEqual(size_t(1), pool.stats().toClean);
+			Assert::AreEqual(size_t(3), pool.stats().cleanQueueDrops);
+			executor.run();
+
+			// Make room in the cleaning queue
+			pool.setMaxToClean(10);
+			{
+				auto use1 = pool.use(L"a");
+				auto use2 = pool.use(L"a");
+				auto use3 = pool.use(L"b");
+				auto use4 = pool.use(L"b");
+			}
+			Assert::AreEqual(size_t(4), pool.stats().toClean);
+			executor.run();
+			Assert::AreEqual(size_t(4), pool.stats().inventory);
+
+			// Shrinking trims in the background
+			pool.setMaxInventory(2);
+			Assert::AreEqual(size_t(4), pool.stats().inventory);
+			executor.run();
+			Assert::AreEqual(size_t(2), pool.stats().inventory);
+			Assert::AreEqual(size_t(2), pool.stats().inventoryDrops);
+
+			// Let the trimmed objects get deleted
+			Assert::AreEqual(size_t(1), executor.run());
+		}
+
+		TEST_METHOD(TestShutdown)
+		{
+			int startCount = test_class_count.load();
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, false);
+					}
+				);
+
+			// Stock up on enough objects to take a few threads to delete
+			for (int i = 0; i < 500; ++i)
+				pool.use(std::to_wstring(i));
+			Assert::AreEqual(size_t(500), pool.stats().inventory);
+			Assert::AreEqual(startCount + 500, test_class_count.load());
+
+			// Everything gets deleted well before the deadline
+			Assert::IsTrue(pool.shutdown(std::chrono::steady_clock::now() + 10s));
+			Assert::AreEqual(size_t(0), pool.stats().inventory);
+			Assert::AreEqual(startCount, test_class_count.load());
+
+			// Objects put back afterwards are deleted as they come back
+			{
+				auto use = pool.use(L"after");
+				Assert::AreEqual(startCount + 1, test_class_count.load());
+			}
+			Assert::AreEqual(startCount, test_class_count.load());
+
+			// Deletion is shared out on the pool's executor, given more than one core,
+			// and the caller can do it all if the executor does not get to it
+			manual_executor executor;
+			{
+				reuse::pool<test_class>
+					other
+					(
+						[&](const std::wstring& initializer)
+						{
+							return new test_class(initializer, false);
+						},
+						1000U,
+						1000U,
+						overflow::drop,
+						executor
+					);
+				for (int i = 0; i < 500; ++i)
+					other.use(std::to_wstring(i));
+				Assert::IsTrue(other.shutdown());
+				Assert::AreEqual(startCount, test_class_count.load());
+				size_t jobs = executor.run();
+				Assert::IsTrue(jobs > 0 || std::thread::hardware_concurrency() <= 1);
+			}
+		}
+
+		TEST_METHOD(TestReclaimBuckets)
+		{
+			pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						return new test_class(initializer, false);
+					},
+					10
+				);
+
+			// A parade of initializers, most of whose objects get dropped
+			for (int i = 0; i < 1000; ++i)
+				pool.use(std::to_wstring(i));
+			Assert::AreEqual(size_t(10), pool.stats().inventory);
+
+			// The buckets with nothing in them have been let go
+			Assert::IsTrue(pool.stats().buckets < 100);
+
+			// The buckets holding objects are still there to hand them out
+			pool.drain();
+			int startCount = test_class_count.load();
+			for (int i = 0; i < 1000; ++i)
+				pool.use(std::to_wstring(i));
+			pool.drain();
+			Assert::AreEqual(size_t(10), pool.stats().inventory);
+			Assert::AreEqual(startCount, test_class_count.load());
+
+			// Buckets whose constructor failed are let go too
+			reuse::pool<test_class>
+				failing
+				(
+					[&](const std::wstring& initializer) -> test_class*
+					{
+						if (initializer[0] == L'x')
+							throw std::runtime_error("tenant is gone");
+						return new test_class(initializer, false);
+					},
+					10
+				);
+			for (int i = 0; i < 1000; ++i)
+				Assert::ExpectException<std::runtime_error>([&]() { failing.use(L"x" + std::to_wstring(i)); });
+			for (int i = 0; i < 1000; ++i)
+				failing.use(std::to_wstring(i));
+			Assert::IsTrue(failing.stats().buckets < 100);
+
+			// Unless their circuit breaker is holding off the constructor
+			failing.setCircuitBreaker(1, 1h);
+			Assert::ExpectException<std::runtime_error>([&]() { failing.use(L"xdead"); });
+			for (int i = 1000; i < 2000; ++i)
+				failing.use(std::to_wstring(i));
+			Assert::ExpectException<std::runtime_error>([&]() { failing.use(L"xdead"); });
+			Assert::AreEqual(size_t(1), failing.stats().fastFails);
+		}
+
+		TEST_METHOD(TestKeys)
+		{
+			// Integer keys
+			{
+				int constructions = 0;
+				pool<shard_test_class>
+					pool
+					(
+						[&](int shard)
+						{
+							++constructions;
+							return new shard_test_class(shard);
+						}
+					);
+				{
+					auto use = pool.use(7);
+					Assert::AreEqual(7, use.get().initializer());
+				}
+				{
+					auto use = pool.use(7);
+				}
+				{
+					auto use = pool.use(8);
+				}
+				Assert::AreEqual(2, constructions);
+				Assert::AreEqual(size_t(2), pool.stats().inventory);
+			}
+
+			// Narrow string keys looked up by string_view
+			{
+				int constructions = 0;
+				pool<narrow_test_class, std::string, narrow_hash, std::equal_to<>>
+					pool
+					(
+						[&](const std::string& name)
+						{
+							++constructions;
+							return new narrow_test_class(name);
+						}
+					);
+				std::string_view name = "orders";
+				{
+					auto use = pool.use(name);
+					Assert::AreEqual(std::string("orders"), use.get().initializer());
+				}
+				{
+					auto use = pool.use(name);
+				}
+				{
+					auto use = pool.use("orders");
+				}
+				Assert::AreEqual(1, constructions);
+			}
+		}
+
+		TEST_METHOD(TestEnumeratedKeys)
+		{
+			int constructions = 0;
+			pool<role_test_class>
+				pool
+				(
+					[&](const role& r)
+					{
+						++constructions;
+						return new role_test_class(r);
+					}
+				);
+
+			// One bucket per role, all there from the start
+			Assert::AreEqual(size_t(3), pool.stats().buckets);
+
+			{
+				auto reader = pool.use(role::reader);
+				auto writer = pool.use(role::writer);
+				Assert::IsTrue(reader.get().initializer() == role::reader);
+				Assert::IsTrue(writer.get().initializer() == role::writer);
+			}
+			{
+				auto writer = pool.use(role::writer);
+				Assert::IsTrue(writer.get().initializer() == role::writer);
+			}
+			{
+				auto admin = pool.use(role::admin);
+				Assert::IsTrue(admin.get().initializer() == role::admin);
+			}
+			Assert::AreEqual(3, constructions);
+			Assert::AreEqual(size_t(3), pool.stats().buckets);
+
+			// Keys past the enumeration are turned away
+			Assert::ExpectException<std::out_of_range>([&]() { pool.use(role::count); });
+			Assert::ExpectException<std::out_of_range>([&]() { pool.use(static_cast<role>(7)); });
+			Assert::AreEqual(3, constructions);
+		}
+
+		TEST_METHOD(TestRealtime)
+		{
+			int constructions = 0;
+			realtime_pool<test_class>
+				pool
+				(
+					[&](const std::wstring& initializer)
+					{
+						++constructions;
+						return new test_class(initializer, false);
+					},
+					2,
+					L"feed"
+				);
+
+			// Everything is made up front
+			Assert::AreEqual(2, constructions);
+			Assert::AreEqual(size_t(2), pool.stats().available);
+
+			test_class* first = pool.get();
+			{
+				auto second = pool.use();
+				Assert::IsTrue(bool(second));
+				second.get().process();
+
+				// Exhausted, so we come back empty handed rather than constructing
+				auto third = pool.use();
+				Assert::IsTrue(!third);
+				Assert::AreEqual(size_t(1), pool.stats().exhausted);
+				Assert::AreEqual(size_t(0), pool.stats().available);
+			}
+			Assert::AreEqual(size_t(1), pool.stats().available);
+
+			// The object comes back clean
+			{
+				auto second = pool.use();
+				Assert::IsTrue(bool(second));
+				Assert::IsTrue(&second.get() != first);
+				Assert::AreEqual(std::string(), second.get().data);
+			}
+
+			pool.put(first);
+			Assert::AreEqual(size_t(2), pool.stats().available);
+			Assert::AreEqual(2, constructions);
+
+			// Hammer it from a few threads, never getting an object someone else has
+			std::atomic<int> inUse = 0;
+			std::atomic<bool> collided = false;
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; ++t)
+			{
+				threads.emplace_back([&]()
+				{
+					for (int i = 0; i < 10000; ++i)
+					{
+						auto use = pool.use();
+						if (!use)
+							continue;
+						if (++inUse > 2)
+							collided = true;
+						--inUse;
+					}
+				});
+			}
+			for (auto& thread : threads)
+				thread.join();
+			Assert::IsTrue(!collided);
+			Assert::AreEqual(size_t(2), pool.stats().available);
+			Assert::AreEqual(2, constructions);
+		}
 	};
 }
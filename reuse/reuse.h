@@ -1,46 +1,80 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
-#include <unordered_map>
+#include <type_traits>
 #include <vector>
 
 namespace reuse
 {
 	using namespace std::chrono_literals;
 
+	template
+	<
+		class T,
+		class Key = typename T::key_type,
+		class Hash = std::hash<Key>,
+		class KeyEqual = std::equal_to<Key>
+	>
+	class pool;
+
+	template <class T>
+	class realtime_pool;
+
 	/// <summary>
 	/// Implement reusable for the types you want to pool
+	/// Derive from basic_reusable directly to key objects by something other than wide strings,
+	/// like integer shard IDs or narrow strings
 	/// </summary>
-	class reusable
+	/// <typeparam name="Key">The initializer type</typeparam>
+	template <class Key>
+	class basic_reusable
 	{
+	public:
+		typedef Key key_type;
+
 	protected: // this class cannot be instantiated
 		/// <summary>
-		/// The initializer string, like a database connection string, is used to pool objects
+		/// The initializer, like a database connection string, is used to pool objects
 		/// of the same type but different initializers, allowing for different connection strings
-		/// Use of initializer strings is optional
+		/// Use of initializers is optional, the default Key like an empty string is the catch-all
 		/// </summary>
-		/// <param name="initializer">string passed to constructor of T by pool.get()</param>
-		reusable(const std::wstring& initializer = L"")
+		/// <param name="initializer">initializer passed to constructor of T by pool.get()</param>
+		basic_reusable(const Key& initializer = Key())
 			: m_initializer(initializer)
 		{}
-		reusable(const reusable&) = delete;
-		reusable(reusable&&) = delete;
-		reusable& operator=(const reusable&) = delete;
+		basic_reusable(const basic_reusable&) = delete;
+		basic_reusable(basic_reusable&&) = delete;
+		basic_reusable& operator=(const basic_reusable&) = delete;
 
 	public:
-		virtual ~reusable() {}
+		virtual ~basic_reusable() {}
 
 		/// <summary>
 		/// How do we return this object to a reusable state?
+		/// Throw an exception if the object cannot be made reusable, and the pool will discard it
 		/// </summary>
 		virtual void clean() {}
 
+		/// <summary>
+		/// Is this object still any good, like a connection whose file has not vanished?
+		/// Called as the object is handed out, at most once per the pool's validation interval,
+		/// so keep this cheap
+		/// Return false or throw an exception, and the pool discards the object
+		/// </summary>
+		virtual bool validate() { return true; }
+
 		/// <summary>
 		/// Should this type be cleaned up in the background?
 		/// If the clean() routine is lengthy and/or resource intensive this may make sense
@@ -49,14 +83,538 @@ namespace reuse
 		/// <returns></returns>
 		virtual bool cleanInBackground() const { return false; }
 
+		/// <summary>
+		/// Does this type call markDirty() whenever it is mutated?
+		/// If so, objects that come back to the pool unmodified skip clean() entirely,
+		/// including the trip through the background cleaning queue
+		/// Otherwise every object is treated as dirty and cleaned when it is put back
+		/// </summary>
+		virtual bool trackDirty() const { return false; }
+
+		/// <summary>
+		/// Flag this object as needing clean() before it is handed out again
+		/// Only consulted for types that return true from trackDirty()
+		/// </summary>
+		void markDirty() { m_dirty = true; }
+
+		/// <summary>
+		/// Does this object need clean() before it can be reused?
+		/// </summary>
+		bool needsClean() const { return m_dirty || !trackDirty(); }
+
+		/// <summary>
+		/// Shrink this object down while it sits idle, like releasing SQLite cache memory
+		/// or buffer capacity, while keeping it cheaper to wake up than to construct
+		/// Called in the background for objects idle longer than the pool's hibernation threshold
+		/// Throw an exception if the object is left unusable, and the pool discards it
+		/// </summary>
+		virtual void hibernate() {}
+
+		/// <summary>
+		/// Bring a hibernated object back to full strength as it is handed out
+		/// Throw an exception if the object cannot be woken up, and the pool discards it
+		/// and hands out another object
+		/// </summary>
+		virtual void wake() {}
+
+		/// <summary>
+		/// Rebind this idle object to a different initializer, like resizing a buffer
+		/// or reopening a connection on an already allocated object
+		/// Pools that allow reinitialization call this to fill a miss with another bucket's surplus
+		/// Return false if the object cannot be rebound, and it stays with its initializer
+		/// Throw an exception if the object is left unusable, and the pool discards it
+		/// </summary>
+		/// <param name="initializer">The new initializer for the object</param>
+		virtual bool reinitialize(const Key&) { return false; }
+
+		/// <summary>
+		/// Make a new object that is a copy of this one, for pools that construct by cloning a prototype
+		/// Implement this for types that are expensive to build but cheap to copy once warmed up
+		/// The clone must be the same type as this object
+		/// </summary>
+		/// <returns>The new object, or nullptr if this type cannot be cloned</returns>
+		virtual basic_reusable* clone() const { return nullptr; }
+
+		/// <summary>
+		/// How many bytes does this object hold onto?
+		/// Report this to let pools limit their inventory by memory footprint, not just object count
+		/// This is called as the object goes on the shelf, after it has been cleaned
+		/// </summary>
+		virtual size_t footprint() const { return 0; }
+
 		/// <summary>
 		/// What is the intializer for this object?
-		/// This is used by the pool machinery to put objects into initializer-specific buckets
+		/// This is the initializer the object was constructed with, or last rebound to by reinitialize()
+		/// Pools keep track of which bucket an object came from, so they do not call this to put objects away
+		/// </summary>
+		const Key& initializer() const { return m_initializer; }
+
+	private:
+		template <class T, class K, class H, class E> friend class pool;
+		template <class T> friend class realtime_pool;
+
+		Key m_initializer;
+		bool m_dirty = false;
+		void* m_bucket = nullptr; // the pool bucket this object was handed out from
+		size_t m_generation = 0; // the bucket generation this object was made for
+		size_t m_footprint = 0; // bytes charged against memory budgets while on the shelf
+		std::chrono::steady_clock::time_point m_shelvedAt; // when the object last went on the shelf
+		std::chrono::steady_clock::time_point m_createdAt; // when the pool constructed the object
+		size_t m_uses = 0; // how many times the object has been handed out
+		std::chrono::steady_clock::time_point m_validatedAt; // when the object was last known to be good
+
+		// Links for the pool's shelves, so objects go on and off shelves without allocating
+		basic_reusable* m_prev = nullptr;
+		basic_reusable* m_next = nullptr;
+
+		size_t m_slot = 0; // where a realtime_pool keeps this object
+	};
+
+	/// <summary>
+	/// Objects pooled by wide string initializers, like database connection strings
+	/// </summary>
+	typedef basic_reusable<std::wstring> reusable;
+
+	/// <summary>
+	/// Does a hash or equality functor take other types than the key, like string_view for string?
+	/// Pools with transparent functors look up initializers without converting them to keys
+	/// </summary>
+	template <class F, class = void>
+	struct is_transparent : std::false_type {};
+
+	template <class F>
+	struct is_transparent<F, std::void_t<typename F::is_transparent>> : std::true_type {};
+
+	/// <summary>
+	/// Specialize enumerated_keys for initializer types with a set of values known at build time,
+	/// like an enum of database roles, and pools keep their buckets in a flat array
+	/// indexed by slot(), with no hashing and no key compares
+	/// count is how many keys there are, slot() maps a key to [0, count), and key() maps back
+	/// Pools throw std::out_of_range for keys whose slot is count or more
+	/// </summary>
+	template <class Key>
+	struct enumerated_keys
+	{
+		static constexpr bool enumerated = false;
+		static constexpr size_t count = 0;
+	};
+
+	/// <summary>
+	/// enumerated_keys for an enum whose values run from zero up to Count, like:
+	/// enum class role { reader, writer, admin, count };
+	/// template <> struct reuse::enumerated_keys<role> : reuse::enum_keys<role, role::count> {};
+	/// </summary>
+	template <class Enum, Enum Count>
+	struct enum_keys
+	{
+		static_assert(std::is_enum_v<Enum>, "enum_keys is for enums");
+
+		static constexpr bool enumerated = true;
+		static constexpr size_t count = static_cast<size_t>(Count);
+		static constexpr size_t slot(Enum key) { return static_cast<size_t>(key); }
+		static constexpr Enum key(size_t slot) { return static_cast<Enum>(slot); }
+	};
+
+	/// <summary>
+	/// An executor runs the pool's background work, cleaning and destroying objects
+	/// Implement executor to run that work on the scheduler the rest of your program uses
+	/// </summary>
+	class executor
+	{
+	public:
+		virtual ~executor() {}
+
+		/// <summary>
+		/// Run the job sometime soon, on whatever thread makes sense
+		/// Every job posted must get run before the pool that posted it can be destroyed
+		/// </summary>
+		virtual void post(std::function<void()>&& job) = 0;
+	};
+
+	/// <summary>
+	/// function_executor adapts anything with a way to post a job, like a work-stealing
+	/// thread pool or an io_context, into an executor
+	/// </summary>
+	class function_executor : public executor
+	{
+	public:
+		/// <summary>
+		/// Wrap up a posting function
+		/// </summary>
+		/// <param name="post">Function that hands a job off to your scheduler</param>
+		function_executor(std::function<void(std::function<void()>&&)> post)
+			: m_post(post)
+		{}
+
+		virtual void post(std::function<void()>&& job)
+		{
+			m_post(std::move(job));
+		}
+
+	private:
+		const std::function<void(std::function<void()>&&)> m_post;
+	};
+
+	/// <summary>
+	/// cleaner is the process-wide set of threads that pools share
+	/// for cleaning objects in the background, unless they are given another executor
+	/// Threads are started on first use, so declaring pools does not start threads
+	/// </summary>
+	class cleaner : public executor
+	{
+	public:
+		/// <summary>
+		/// Get the one cleaner for the process
+		/// </summary>
+		static cleaner& shared()
+		{
+			static cleaner s_cleaner;
+			return s_cleaner;
+		}
+
+		/// <summary>
+		/// Set how many threads the process devotes to background cleaning
+		/// If the threads are running, threads are started or stopped to match,
+		/// and stopping threads finish the job they are on first
+		/// </summary>
+		/// <param name="threadCount">How many cleaning threads to run</param>
+		static void setThreadCount(size_t threadCount)
+		{
+			cleaner& c = shared();
+			std::unique_lock<std::mutex> lock(c.m_mutex);
+			c.m_threadCount = std::max(threadCount, size_t(1));
+			if (!c.m_threads.empty())
+				c.staff();
+		}
+
+		/// <summary>
+		/// How many threads does the process devote to background cleaning?
+		/// </summary>
+		static size_t threadCount()
+		{
+			cleaner& c = shared();
+			std::unique_lock<std::mutex> lock(c.m_mutex);
+			return c.m_threadCount;
+		}
+
+		~cleaner()
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_keepRunning = false;
+				m_condition.notify_all();
+			}
+			for (auto& thread : m_threads)
+				thread.join();
+		}
+
+		/// <summary>
+		/// Queue up work to do on a cleaning thread
+		/// </summary>
+		virtual void post(std::function<void()>&& job)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_threads.empty())
+				staff();
+			m_jobs.push_back(std::move(job));
+			m_condition.notify_one();
+		}
+
+	private:
+		cleaner()
+			: m_threadCount(std::max(std::thread::hardware_concurrency() / 2, 1U))
+		{}
+
+		/// <summary>
+		/// Start or stop threads to match the thread count
+		/// Call with m_mutex held
+		/// </summary>
+		void staff()
+		{
+			// Reap the threads that have stopped
+			for (std::thread::id id : m_stopped)
+			{
+				auto it =
+					std::find_if
+					(
+						m_threads.begin(),
+						m_threads.end(),
+						[&](const std::thread& thread) { return thread.get_id() == id; }
+					);
+				it->join();
+				m_threads.erase(it);
+			}
+			m_stopped.clear();
+
+			size_t running = m_threads.size() - m_stopping;
+			if (m_threadCount > running)
+			{
+				// Call off stops before starting new threads
+				size_t unstopped = std::min(m_stopping, m_threadCount - running);
+				m_stopping -= unstopped;
+				running += unstopped;
+				for (; running < m_threadCount; ++running)
+					m_threads.emplace_back([this]() { work(); });
+			}
+			else if (m_threadCount < running)
+			{
+				m_stopping += running - m_threadCount;
+				m_condition.notify_all();
+			}
+		}
+
+		/// <summary>
+		/// Thread routine for doing jobs posted by the pools
 		/// </summary>
-		virtual std::wstring initializer() const { return m_initializer; }
+		void work()
+		{
+			while (true)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [&] { return !m_jobs.empty() || !m_keepRunning || m_stopping > 0; });
+					if (m_stopping > 0 && m_keepRunning)
+					{
+						// Pass along any wakeup meant for a job
+						--m_stopping;
+						m_stopped.push_back(std::this_thread::get_id());
+						if (!m_jobs.empty())
+							m_condition.notify_one();
+						return;
+					}
+					if (m_jobs.empty())
+						return;
+
+					job = std::move(m_jobs.front());
+					m_jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		size_t m_threadCount;
+		std::vector<std::thread> m_threads;
+		size_t m_stopping = 0; // threads asked to stop that have not stopped yet
+		std::vector<std::thread::id> m_stopped; // threads that have stopped and need joining
+		std::deque<std::function<void()>> m_jobs;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+		bool m_keepRunning = true;
+	};
+
+	/// <summary>
+	/// What the registry needs from every pool, whatever type of object it holds
+	/// </summary>
+	class pool_base
+	{
+	public:
+		virtual ~pool_base() {}
+
+		/// <summary>
+		/// Kick off any periodic background work, like hibernating idle objects
+		/// Called regularly by the registry, so this must be quick
+		/// </summary>
+		virtual void maintain() = 0;
+
+		/// <summary>
+		/// How many bytes are held in idle objects?
+		/// </summary>
+		virtual size_t bytes() const = 0;
+
+		/// <summary>
+		/// Discard idle objects to free up memory
+		/// </summary>
+		/// <param name="bytes">How many bytes to try to free</param>
+		/// <returns>How many bytes were freed</returns>
+		virtual size_t trim(size_t bytes) = 0;
+	};
+
+	/// <summary>
+	/// registry keeps track of every pool in the process so that
+	/// a memory budget can be applied across all of them, and so
+	/// periodic work like hibernating idle objects gets kicked off
+	/// </summary>
+	class registry
+	{
+	public:
+		/// <summary>
+		/// Get the one registry for the process
+		/// </summary>
+		static registry& shared()
+		{
+			static registry s_registry;
+			return s_registry;
+		}
+
+		/// <summary>
+		/// Limit the bytes of idle objects held across all pools in the process
+		/// Pools holding the most are trimmed first when the limit is exceeded
+		/// </summary>
+		/// <param name="maxBytes">The byte limit, 0 for no limit</param>
+		void setMaxBytes(size_t maxBytes)
+		{
+			m_maxBytes = maxBytes;
+			enforce();
+		}
+
+		/// <summary>
+		/// How many bytes are held in idle objects across all pools?
+		/// </summary>
+		size_t bytes() const { return m_bytes.load(); }
 
 	private:
-		std::wstring m_initializer;
+		template <class T, class K, class H, class E> friend class pool;
+
+		registry() {}
+
+		~registry()
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_keepRunning = false;
+				m_maintenanceCondition.notify_all();
+			}
+			if (m_maintenanceThread.joinable())
+				m_maintenanceThread.join();
+		}
+
+		/// <summary>
+		/// Start the thread that calls maintain() on every pool, if it is not running already
+		/// Only pools that use timed features like hibernation need this
+		/// </summary>
+		void startMaintenance()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!m_maintenanceThread.joinable() && m_keepRunning)
+				m_maintenanceThread = std::thread([this]() { maintenance(); });
+		}
+
+		/// <summary>
+		/// Thread routine for kicking off periodic work in every pool
+		/// maintain() is called without holding m_mutex, as executors may run the pool's
+		/// work inline, and that work can come back into the registry to enforce budgets
+		/// </summary>
+		void maintenance()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_keepRunning)
+			{
+				std::vector<pool_base*> pools = m_pools;
+				for (pool_base* p : pools)
+				{
+					// Skip pools removed while others were being maintained
+					if (std::find(m_pools.begin(), m_pools.end(), p) == m_pools.end())
+						continue;
+
+					m_maintaining = p;
+					lock.unlock();
+					p->maintain();
+					lock.lock();
+					m_maintaining = nullptr;
+					m_maintainedCondition.notify_all();
+				}
+				m_maintenanceCondition.wait_for(lock, 100ms, [&] { return !m_keepRunning; });
+			}
+		}
+
+		void add(pool_base* t)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_pools.push_back(t);
+		}
+
+		/// <summary>
+		/// Take a pool off the books, waiting out a maintain() call in progress on it
+		/// </summary>
+		void remove(pool_base* t)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_pools.erase(std::remove(m_pools.begin(), m_pools.end(), t), m_pools.end());
+			m_maintainedCondition.wait(lock, [&] { return m_maintaining != t; });
+		}
+
+		void charge(size_t bytes) { m_bytes.fetch_add(bytes); }
+		void credit(size_t bytes) { m_bytes.fetch_sub(bytes); }
+
+		/// <summary>
+		/// Trim the pools holding the most until the process is back under budget
+		/// Call without holding any pool locks
+		/// </summary>
+		void enforce()
+		{
+			size_t maxBytes = m_maxBytes.load();
+			if (maxBytes == 0 || m_bytes.load() <= maxBytes)
+				return;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_bytes.load() > maxBytes)
+			{
+				pool_base* biggest = nullptr;
+				size_t biggestBytes = 0;
+				for (pool_base* t : m_pools)
+				{
+					size_t bytes = t->bytes();
+					if (bytes > biggestBytes)
+					{
+						biggest = t;
+						biggestBytes = bytes;
+					}
+				}
+				if (biggest == nullptr || biggest->trim(m_bytes.load() - maxBytes) == 0)
+					break;
+			}
+		}
+
+		std::vector<pool_base*> m_pools;
+		std::mutex m_mutex;
+		std::atomic<size_t> m_bytes = 0;
+		std::atomic<size_t> m_maxBytes = 0;
+
+		bool m_keepRunning = true;
+		std::thread m_maintenanceThread;
+		std::condition_variable m_maintenanceCondition;
+		pool_base* m_maintaining = nullptr; // the pool maintain() is being called on, guarded by m_mutex
+		std::condition_variable m_maintainedCondition;
+	};
+
+	/// <summary>
+	/// What should happen to an object put back for background cleaning when the cleaning queue is full?
+	/// </summary>
+	enum class overflow
+	{
+		drop, // delete the object
+		clean_inline, // clean the object on the returning thread
+		block // wait briefly for room in the queue, then drop
+	};
+
+	/// <summary>
+	/// Point-in-time counts of what a pool holds and what it has had to throw away
+	/// Use the drop counts to tune maxInventory and maxToClean
+	/// </summary>
+	struct pool_stats
+	{
+		size_t inventory = 0; // objects on the shelves ready to hand out
+		size_t toClean = 0; // objects waiting on background cleaning
+		size_t cleanQueueDrops = 0; // objects deleted because the cleaning queue was full
+		size_t inventoryDrops = 0; // objects deleted because the shelves were full
+		size_t bytes = 0; // footprint of the objects on the shelves and the prototypes
+		size_t budgetDrops = 0; // objects deleted to stay within memory budgets
+		size_t wornOut = 0; // objects retired for age or use count and replaced in the background
+		size_t rejected = 0; // objects discarded because clean(), validate(), hibernate(), or wake() failed
+		size_t hedges = 0; // misses that waited on a return while constructing in the background
+		size_t fastFails = 0; // get() calls failed without constructing because the initializer keeps failing
+		size_t reinitialized = 0; // misses filled by rebinding another bucket's idle object
+		size_t buckets = 0; // initializers the pool is keeping track of
+	};
+
+	/// <summary>
+	/// Limits a pool recommends for itself from the peak concurrency it has seen
+	/// </summary>
+	struct pool_sizing
+	{
+		size_t maxInventory = 0; // peak objects leased at once, summed across initializers, plus headroom
+		size_t maxToClean = 0; // peak objects waiting on background cleaning, plus headroom
 	};
 
 	/// <summary>
@@ -69,8 +627,11 @@ namespace reuse
 	/// The object type to pool
 	/// Can be a base class of a class library
 	/// </typeparam>
-	template <class T>
-	class pool
+	/// <typeparam name="Key">The initializer type, the key_type of T's basic_reusable</typeparam>
+	/// <typeparam name="Hash">Hashes initializers, make it and KeyEqual transparent for lookups by other types</typeparam>
+	/// <typeparam name="KeyEqual">Compares initializers</typeparam>
+	template <class T, class Key, class Hash, class KeyEqual>
+	class pool : public pool_base
 	{
 	public:
 		/// <summary>
@@ -79,207 +640,2300 @@ namespace reuse
 		/// <param name="constructor">What object should be created based on the initializer?</param>
 		/// <param name="maxInventory">How many objects can the pool hold before objects put for recycling are dropped (deleted)?</param>
 		/// <param name="maxToClean">How many objects can be in queue for cleaned before objects are dropped (deleted)?</param>
+		/// <param name="overflowPolicy">What to do with objects put back when the cleaning queue is full</param>
+		/// <param name="backgroundExecutor">What runs background cleaning, the process-wide cleaner by default</param>
 		pool
 		(
-			const std::function<T* (const std::wstring&)> constructor, 
+			const std::function<T* (const Key&)> constructor, 
 			const size_t maxInventory = 1000U, 
-			const size_t maxToClean= 1000U
+			const size_t maxToClean= 1000U,
+			const overflow overflowPolicy = overflow::drop,
+			executor& backgroundExecutor = cleaner::shared()
 		)
 			: m_constructor(constructor)
+			, m_size(0)
 			, m_maxInventory(maxInventory)
 			, m_maxToClean(maxToClean)
-			, m_size(0)
+			, m_overflowPolicy(overflowPolicy)
+			, m_registry(registry::shared())
 			, m_keepRunning(true)
-			, m_doneCleaning(false)
-			, m_cleanupThread([&]() { cleanup(); }) // start the background cleanup thread
-		{}
+			, m_executor(backgroundExecutor)
+		{
+			m_registry.add(this);
+		}
 
 		~pool()
 		{
-			// Raise the flag that the shop is shutting down
-			m_keepRunning = false;
+			// Stop background work and delete what we're holding
+			shutdown();
 
-			// Wait for the background thread to exit
-			while (!m_doneCleaning)
+			// Wait for our jobs on the executor to finish up
 			{
 				std::unique_lock<std::mutex> lock(m_incomingMutex);
-				m_incomingCondition.wait_for
-				(
-					lock,
-					10ms,
-					[&] { return m_doneCleaning; }
+				m_jobsCondition.wait(lock, [&] { return m_jobs == 0; });
+			}
+			m_registry.credit(m_bytes.load());
+
+			// Free memory in the object buckets, for objects shelved by jobs that outlasted the deadline
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+
+				m_unBucket.freeObjects();
+				for (bucket& b : m_initBuckets)
+					b.freeObjects();
+			}
+
+			// Free memory in the incoming lists
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				for (bucket* b : m_pendingBuckets)
+					b->incoming.deleteObjects();
+			}
+		}
+
+		/// <summary>
+		/// Shut the pool down, stopping background work and deleting the objects and prototypes it holds
+		/// Objects are deleted in parallel on the pool's executor, with the calling thread pitching in
+		/// Objects not deleted by the deadline are abandoned, never deleted, so a process
+		/// that is exiting need not wait on them
+		/// The deadline bounds this call, not the destructor, which waits for the pool's
+		/// background work to finish, including deletions that were underway at the deadline
+		/// Objects put back after shutdown are deleted as they are put back
+		/// </summary>
+		/// <param name="deadline">When to give up on deleting objects</param>
+		/// <returns>true if every object was deleted, false if some were abandoned</returns>
+		bool shutdown(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+		{
+			bool hasDeadline = deadline != std::chrono::steady_clock::time_point::max();
+
+			// Get out of process-wide budgeting
+			m_registry.remove(this);
+
+			// Raise the flag that the shop is shutting down, and let cleaning in flight finish
+			shelf objects;
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				m_keepRunning = false;
+				m_incomingRoomCondition.notify_all();
+				if (hasDeadline)
+					m_jobsCondition.wait_until(lock, deadline, [&] { return m_jobs == 0; });
+				else
+					m_jobsCondition.wait(lock, [&] { return m_jobs == 0; });
+
+				for (bucket* b : m_pendingBuckets)
+					objects.splice(b->incoming);
+				m_pendingBuckets.clear();
+				m_incomingCount = 0;
+			}
+
+			// Empty the shelves and let go of the prototypes
+			std::vector<std::shared_ptr<const T>> prototypes;
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				auto empty = [&](bucket& b)
+				{
+					objects.splice(b.objects);
+					objects.splice(b.cold);
+					b.bytes = 0;
+					if (b.prototype)
+						prototypes.push_back(std::move(b.prototype));
+					b.prototypeBytes = 0;
+					b.stocked = false;
+					b.stockedPrev = nullptr;
+					b.stockedNext = nullptr;
+					b.available.notify_all();
+				};
+				empty(m_unBucket);
+				for (bucket& b : m_initBuckets)
+					empty(b);
+				m_stockedFront = nullptr;
+				m_stockedCursor = nullptr;
+				m_stockedCount = 0;
+
+				m_size = 0;
+				m_registry.credit(m_bytes.exchange(0));
+			}
+			prototypes.clear();
+
+			return deleteAll(objects.release(), hasDeadline ? &deadline : nullptr);
+		}
+
+		/// <summary>
+		/// Wait for the pool's background work to finish, so every object queued for cleaning
+		/// has been cleaned and shelved, and every object being retired has been deleted
+		/// The executor must be running jobs, or this waits forever
+		/// </summary>
+		void drain()
+		{
+			std::unique_lock<std::mutex> lock(m_incomingMutex);
+			m_jobsCondition.wait(lock, [&] { return m_jobs == 0; });
+		}
+
+		/// <summary>
+		/// Wait a while for the pool's background work to finish, see drain()
+		/// </summary>
+		/// <param name="timeout">How long to wait</param>
+		/// <returns>true if the work finished, false if the timeout passed first</returns>
+		bool drain_for(std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(m_incomingMutex);
+			return m_jobsCondition.wait_for(lock, timeout, [&] { return m_jobs == 0; });
+		}
+
+		/// <summary>
+		/// Get a reuse object to get an object from the pool
+		/// and automatically return it back to the pool
+		/// </summary>
+		/// <param name="initializer">
+		/// Initializer for the object to return, a Key or anything
+		/// Hash and KeyEqual take if they are transparent
+		/// </param>
+		/// <returns>
+		/// An object for gaining access to a pooled object
+		/// </returns>
+		template <class Probe = Key>
+		auto use(const Probe& initializer = Probe())
+		{
+			return reuse<T>(*this, initializer);
+		}
+
+		/// <summary>
+		/// Mark every object for an initializer as stale, like when the database file
+		/// behind a connection string has been replaced
+		/// Idle objects are destroyed in the background, objects in use are destroyed when put back
+		/// This is constant-time, the shelves are handed off whole with no walking of the bucket
+		/// </summary>
+		/// <param name="initializer">Initializer whose objects are no longer any good</param>
+		template <class Probe = Key>
+		void invalidate(const Probe& initializer = Probe())
+		{
+			shelf stale;
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				bucket* b = bucketFor(initializer);
+				b->generation.fetch_add(1);
+				stale.splice(b->objects);
+				stale.splice(b->cold);
+				stockChanged(b);
+				b->prototype.reset();
+				uncharge(b->prototypeBytes);
+				b->prototypeBytes = 0;
+				m_size.fetch_add(-int(stale.size()));
+				uncharge(b->bytes);
+				b->bytes = 0;
+			}
+			if (!stale.empty())
+				retire(stale);
+		}
+
+		/// <summary>
+		/// Limit the bytes of idle objects this pool holds onto, as reported by reusable::footprint()
+		/// Objects are trimmed when the limit is exceeded, see trim()
+		/// </summary>
+		/// <param name="maxBytes">The byte limit, 0 for no limit</param>
+		void setMaxBytes(size_t maxBytes)
+		{
+			m_maxBytes = maxBytes;
+			enforceBudgets();
+		}
+
+		/// <summary>
+		/// Hibernate objects that sit idle for a while, see reusable::hibernate()
+		/// Hibernated objects move to a cold tier and are woken up as they are handed out
+		/// </summary>
+		/// <param name="idle">How long an object sits on the shelf before hibernating, 0 to never hibernate</param>
+		void setHibernateAfter(std::chrono::milliseconds idle)
+		{
+			m_hibernateAfter = idle;
+			if (idle > 0ms)
+				m_registry.startMaintenance();
+		}
+
+		/// <summary>
+		/// Recycle objects once they have been around too long, like connections whose caches only grow
+		/// Objects past the limit are retired as they are put back or sit idle,
+		/// and replacements are constructed in the background
+		/// Idle objects are checked a few at a time by each maintenance sweep,
+		/// so on large shelves they may outlive the limit by a few sweeps
+		/// </summary>
+		/// <param name="maxAge">How long an object may live, 0 for no limit</param>
+		void setMaxAge(std::chrono::milliseconds maxAge)
+		{
+			m_maxAge = maxAge;
+			if (maxAge > 0ms)
+				m_registry.startMaintenance();
+		}
+
+		/// <summary>
+		/// Recycle objects once they have been handed out too many times
+		/// Objects past the limit are retired as they are put back,
+		/// and replacements are constructed in the background
+		/// </summary>
+		/// <param name="maxUses">How many times an object may be handed out, 0 for no limit</param>
+		void setMaxUses(size_t maxUses)
+		{
+			m_maxUses = maxUses;
+		}
+
+		/// <summary>
+		/// Check objects with reusable::validate() as they are handed out
+		/// Objects that fail are discarded before they get to the caller
+		/// </summary>
+		/// <param name="interval">How long an object goes between validations, 0 to never validate</param>
+		void setValidateInterval(std::chrono::milliseconds interval)
+		{
+			m_validateInterval = interval;
+		}
+
+		/// <summary>
+		/// Limit how many objects can be under construction at once for each initializer
+		/// Further misses wait for a construction to finish or an object to be put back,
+		/// turning a miss storm into a controlled ramp
+		/// </summary>
+		/// <param name="maxConstructing">Constructions in flight per initializer, 0 for no limit</param>
+		void setMaxConstructing(size_t maxConstructing)
+		{
+			m_maxConstructing = maxConstructing;
+
+			// Let waiters see if the new limit lets them through
+			std::unique_lock<std::mutex> lock(m_bucketMutex);
+			m_unBucket.available.notify_all();
+			for (bucket& b : m_initBuckets)
+				b.available.notify_all();
+		}
+
+		/// <summary>
+		/// Limit how many objects the pool constructs per second, across all initializers
+		/// Constructions for get() beyond the rate are spaced out, while background constructions
+		/// beyond the rate are skipped, so executor threads are never put to sleep
+		/// </summary>
+		/// <param name="perSecond">Constructions per second, 0 for no limit</param>
+		void setConstructionRate(double perSecond)
+		{
+			m_constructionRate = perSecond;
+		}
+
+		/// <summary>
+		/// Hedge misses: when an object is likely to be put back sooner than one could be constructed,
+		/// start constructing one in the background and wait for whichever shows up first
+		/// The extra object goes on the shelf
+		/// Decisions are based on measured construction times and how often objects are put back
+		/// </summary>
+		void setHedging(bool hedging)
+		{
+			m_hedging = hedging;
+		}
+
+		/// <summary>
+		/// Stop calling the constructor for an initializer that keeps failing, like a database
+		/// file that cannot be opened
+		/// After enough failures in a row, get() rethrows the last failure without constructing
+		/// until the backoff passes, then lets one call through to see if things are better
+		/// </summary>
+		/// <param name="failureThreshold">Consecutive constructor failures before failing fast, 0 to never fail fast</param>
+		/// <param name="backoff">How long to fail fast before trying the constructor again</param>
+		void setCircuitBreaker(size_t failureThreshold, std::chrono::milliseconds backoff)
+		{
+			m_failureThreshold = failureThreshold;
+			m_failureBackoff = backoff;
+		}
+
+		/// <summary>
+		/// Change how many objects the pool can hold
+		/// Shrinking trims the cheapest idle objects in the background
+		/// Adaptive sizing overrides this at the end of each window, see setAdaptiveSizing()
+		/// </summary>
+		/// <param name="maxInventory">How many objects can the pool hold before objects put for recycling are dropped (deleted)?</param>
+		void setMaxInventory(size_t maxInventory)
+		{
+			if (m_maxInventory.exchange(maxInventory) <= maxInventory)
+				return;
+
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				if (!m_keepRunning)
+					return;
+				++m_jobs;
+			}
+			m_executor.post
+			(
+				[this]()
+				{
+					shrinkInventory();
+					finishJob();
+				}
+			);
+		}
+
+		/// <summary>
+		/// Change how many objects can wait on background cleaning
+		/// Objects already queued stay queued, the new limit applies to objects put back from now on
+		/// Adaptive sizing overrides this at the end of each window, see setAdaptiveSizing()
+		/// </summary>
+		/// <param name="maxToClean">How many objects can be in queue for cleaned before objects are dropped (deleted)?</param>
+		void setMaxToClean(size_t maxToClean)
+		{
+			std::unique_lock<std::mutex> lock(m_incomingMutex);
+			m_maxToClean = maxToClean;
+			m_incomingRoomCondition.notify_all();
+		}
+
+		/// <summary>
+		/// Fill misses by rebinding idle objects from other buckets, see reusable::reinitialize()
+		/// Objects are taken from the bucket with the least need that has more than one idle object,
+		/// out of a few buckets sampled on each miss
+		/// Rebinding counts as constructing: it takes a construction slot and a turn under the rate limit,
+		/// failures count toward the circuit breaker, and a tripped breaker stops rebinding for the initializer
+		/// </summary>
+		void setReinitialize(bool reinitialize)
+		{
+			m_reinitialize = reinitialize;
+		}
+
+		/// <summary>
+		/// Construct objects by cloning a prototype per initializer, see reusable::clone()
+		/// The first object constructed for an initializer is cloned to make the prototype,
+		/// then misses clone the prototype instead of calling the constructor
+		/// Prototypes count toward bytes() and memory budgets by their footprint(), but trimming
+		/// leaves them be, they are let go by invalidate(), shutdown(), and reclaiming their bucket
+		/// </summary>
+		void setPrototyping(bool prototyping)
+		{
+			m_prototyping = prototyping;
+		}
+
+		/// <summary>
+		/// Size maxInventory and maxToClean to the peak concurrency seen recently
+		/// At the end of each window, the limits are set to recommendedSizing()
+		/// and inventory beyond the new limit is trimmed
+		/// </summary>
+		/// <param name="window">How long each window of peak tracking lasts, 0 to stop adapting</param>
+		/// <param name="headroom">Fraction to add to the peaks, 0.25 sizes to 125% of peak</param>
+		void setAdaptiveSizing(std::chrono::milliseconds window, double headroom = 0.25)
+		{
+			m_sizingHeadroom = headroom;
+			m_sizingWindow = window;
+			if (window > 0ms)
+				m_registry.startMaintenance();
+		}
+
+		/// <summary>
+		/// What limits fit the peak concurrency of the current and previous windows?
+		/// Without adaptive sizing there is one window that never ends, so this covers the pool's lifetime
+		/// </summary>
+		pool_sizing recommendedSizing()
+		{
+			size_t peakLeased = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				peakLeased += std::max(m_unBucket.peakLeased.load(), m_unBucket.previousPeakLeased);
+				for (bucket& b : m_initBuckets)
+					peakLeased += std::max(b.peakLeased.load(), b.previousPeakLeased);
+			}
+
+			size_t peakIncoming = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				peakIncoming = std::max(m_peakIncoming, m_previousPeakIncoming);
+			}
+
+			double headroom = 1.0 + m_sizingHeadroom.load();
+			pool_sizing ret_val;
+			ret_val.maxInventory = std::max(size_t(std::ceil(peakLeased * headroom)), size_t(1));
+			ret_val.maxToClean = std::max(size_t(std::ceil(peakIncoming * headroom)), size_t(1));
+			return ret_val;
+		}
+
+		/// <summary>
+		/// How many bytes are held in idle objects and prototypes?
+		/// </summary>
+		virtual size_t bytes() const
+		{
+			return m_bytes.load();
+		}
+
+		/// <summary>
+		/// Post a sweep for objects to hibernate or retire, if hibernation, a max age,
+		/// or adaptive sizing is set and a sweep is not already underway
+		/// </summary>
+		virtual void maintain()
+		{
+			if
+			(
+				(m_hibernateAfter.load() == 0ms && m_maxAge.load() == 0ms && m_sizingWindow.load() == 0ms)
+				||
+				m_sweeping.exchange(true)
+			)
+			{
+				return;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				if (!m_keepRunning)
+				{
+					m_sweeping = false;
+					return;
+				}
+				++m_jobs;
+			}
+			m_executor.post
+			(
+				[this]()
+				{
+					adaptSizing();
+					if (m_hibernateAfter.load() > 0ms || m_maxAge.load() > 0ms)
+						sweep();
+					m_sweeping = false;
+					finishJob();
+				}
+			);
+		}
+
+		/// <summary>
+		/// Discard the oldest idle objects, starting with the buckets that are
+		/// cheapest to restock for the bytes they hold
+		/// The objects are destroyed in the background
+		/// </summary>
+		/// <param name="bytes">How many bytes to try to free</param>
+		/// <returns>How many bytes were freed</returns>
+		virtual size_t trim(size_t bytes)
+		{
+			std::vector<T*> victims;
+			size_t freed = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				while (freed < bytes)
+				{
+					bucket* b = cheapestBucket(true);
+					if (b == nullptr)
+						break;
+
+					// Hibernated objects hold little, so free bytes from the hot shelf first
+					T* t = takeOldest(b, true);
+					freed += t->m_footprint;
+					victims.push_back(t);
+				}
+			}
+			if (!victims.empty())
+			{
+				m_budgetDrops.fetch_add(victims.size());
+				retire(std::move(victims));
+			}
+			return freed;
+		}
+
+		/// <summary>
+		/// Get a snapshot of the pool's inventory and drop counts
+		/// </summary>
+		pool_stats stats()
+		{
+			pool_stats ret_val;
+			ret_val.inventory = size_t(std::max(m_size.load(), 0));
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				ret_val.toClean = m_incomingCount;
+			}
+			ret_val.cleanQueueDrops = m_cleanQueueDrops.load();
+			ret_val.inventoryDrops = m_inventoryDrops.load();
+			ret_val.bytes = m_bytes.load();
+			ret_val.budgetDrops = m_budgetDrops.load();
+			ret_val.wornOut = m_wornOut.load();
+			ret_val.rejected = m_rejected.load();
+			ret_val.hedges = m_hedges.load();
+			ret_val.fastFails = m_fastFails.load();
+			ret_val.reinitialized = m_reinitialized.load();
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				ret_val.buckets = m_initBuckets.size();
+			}
+			return ret_val;
+		}
+
+	private:
+		/// <summary>
+		/// A list of objects linked through reusable, so putting objects on and taking them off
+		/// is a few pointer swaps that never allocate, even with the bucket lock held
+		/// An object is on one shelf at a time, and objects are kept in the order they are pushed
+		/// </summary>
+		class shelf
+		{
+			typedef basic_reusable<Key> node;
+
+		public:
+			shelf() {}
+			shelf(const shelf&) = delete;
+			shelf& operator=(const shelf&) = delete;
+
+			bool empty() const { return m_front == nullptr; }
+			size_t size() const { return m_size; }
+			T* front() const { return static_cast<T*>(m_front); }
+			static T* next(T* t) { return static_cast<T*>(t->m_next); }
+
+			void push_back(T* t)
+			{
+				t->m_prev = m_back;
+				t->m_next = nullptr;
+				if (m_back != nullptr)
+					m_back->m_next = t;
+				else
+					m_front = t;
+				m_back = t;
+				++m_size;
+			}
+
+			T* pop_back()
+			{
+				T* t = static_cast<T*>(m_back);
+				erase(t);
+				return t;
+			}
+
+			T* pop_front()
+			{
+				T* t = static_cast<T*>(m_front);
+				erase(t);
+				return t;
+			}
+
+			/// <summary>
+			/// Take an object off of the shelf, wherever it is
+			/// </summary>
+			void erase(T* t)
+			{
+				node* prev = t->m_prev;
+				node* next = t->m_next;
+				if (t == m_cursor)
+					m_cursor = next;
+				if (prev != nullptr)
+					prev->m_next = next;
+				else
+					m_front = next;
+				if (next != nullptr)
+					next->m_prev = prev;
+				else
+					m_back = prev;
+				t->m_prev = nullptr;
+				t->m_next = nullptr;
+				--m_size;
+			}
+
+			/// <summary>
+			/// Move all the objects from another shelf onto the end of this one
+			/// </summary>
+			void splice(shelf& other)
+			{
+				if (other.empty())
+					return;
+
+				if (m_back != nullptr)
+				{
+					m_back->m_next = other.m_front;
+					other.m_front->m_prev = m_back;
+				}
+				else
+					m_front = other.m_front;
+				m_back = other.m_back;
+				m_size += other.m_size;
+
+				other.m_front = nullptr;
+				other.m_back = nullptr;
+				other.m_size = 0;
+				other.m_cursor = nullptr;
+			}
+
+			/// <summary>
+			/// Where a walk of the shelf spread across calls picks up, the front if it is starting over
+			/// The cursor steps past objects as they are taken off of the shelf
+			/// </summary>
+			T* cursor() const { return static_cast<T*>(m_cursor != nullptr ? m_cursor : m_front); }
+			void setCursor(T* t) { m_cursor = t; }
+
+			/// <summary>
+			/// Take all the objects off of the shelf, in order, for handing off to deleteAll()
+			/// </summary>
+			std::vector<T*> release()
+			{
+				std::vector<T*> ret_val;
+				ret_val.reserve(m_size);
+				while (!empty())
+					ret_val.push_back(pop_front());
+				return ret_val;
+			}
+
+			/// <summary>
+			/// Delete all the objects on the shelf
+			/// </summary>
+			void deleteObjects()
+			{
+				while (!empty())
+					delete pop_front();
+			}
+
+		private:
+			node* m_front = nullptr;
+			node* m_back = nullptr;
+			size_t m_size = 0;
+			node* m_cursor = nullptr;
+		};
+
+		/// <summary>
+		/// Objects for one initializer, along with how badly the initializer has needed them lately
+		/// </summary>
+		struct bucket
+		{
+			Key initializer; // what the objects are constructed with
+			shelf objects; // ready to hand out, oldest first, guarded by m_bucketMutex
+			shelf cold; // hibernated, oldest first, guarded by m_bucketMutex
+			shelf incoming; // waiting on background cleaning, guarded by m_incomingMutex
+			std::atomic<size_t> generation = 0; // bumped by invalidate() to make the objects out there stale
+			size_t bytes = 0; // footprint of objects, guarded by m_bucketMutex
+			double constructSeconds = 0.0; // moving average of constructor time, guarded by m_bucketMutex
+
+			// Constructions in flight and get() calls waiting on them, guarded by m_bucketMutex
+			size_t constructing = 0;
+			size_t waiting = 0;
+			std::condition_variable available; // signaled as objects are shelved and constructions finish
+
+			// Objects handed out and not yet put back
+			std::atomic<size_t> leased = 0;
+
+			// Moving average of time between objects coming back to the shelf, guarded by m_bucketMutex
+			double returnSeconds = 0.0;
+			std::chrono::steady_clock::time_point returnedAt;
+
+			// Circuit breaker state for a failing constructor, guarded by m_bucketMutex
+			size_t failures = 0; // in a row
+			std::exception_ptr lastFailure;
+			std::chrono::steady_clock::time_point failFastUntil;
+			bool probing = false; // one call is through to see if the constructor works again
+
+			// Decaying count of recent misses, guarded by m_bucketMutex
+			double demand = 0.0;
+			std::chrono::steady_clock::time_point demandAt;
+
+			// Object to clone for misses, guarded by m_bucketMutex
+			// Shared so a clone in progress outlives invalidate()
+			std::shared_ptr<const T> prototype;
+			size_t prototypeBytes = 0; // footprint of the prototype, charged to the pool, guarded by m_bucketMutex
+
+			// Most objects out at once in this sizing window and the last one
+			std::atomic<size_t> peakLeased = 0;
+			size_t previousPeakLeased = 0; // guarded by m_bucketMutex
+
+			// Objects alive that were made for this bucket, plus background constructions for it
+			std::atomic<size_t> refs = 0;
+
+			// Links for the list of buckets with idle objects, so buckets go on and off the list
+			// without allocating, guarded by m_bucketMutex
+			bool stocked = false;
+			bucket* stockedPrev = nullptr;
+			bucket* stockedNext = nullptr;
+
+			/// <summary>
+			/// Can the bucket be reclaimed? Nothing made for it is alive, nobody is waiting on it
+			/// or constructing for it, and its circuit breaker is not holding off its constructor
+			/// Failures short of tripping the breaker, or a backoff that has passed, do not keep a bucket
+			/// Call with m_bucketMutex held
+			/// </summary>
+			/// <param name="failureThreshold">The pool's circuit breaker threshold, 0 if it has none</param>
+			bool quiet(std::chrono::steady_clock::time_point now, size_t failureThreshold) const
+			{
+				bool failingFast = tripped(failureThreshold) && now < failFastUntil;
+				return refs.load() == 0 && waiting == 0 && constructing == 0 && !failingFast;
+			}
+
+			/// <summary>
+			/// Has the bucket failed enough in a row to trip the circuit breaker?
+			/// Call with m_bucketMutex held
+			/// </summary>
+			/// <param name="failureThreshold">The pool's circuit breaker threshold, 0 if it has none</param>
+			bool tripped(size_t failureThreshold) const
+			{
+				return failureThreshold > 0 && failures >= failureThreshold;
+			}
+
+			/// <summary>
+			/// How many objects are on the shelf, hibernating or not?
+			/// </summary>
+			size_t idle() const
+			{
+				return objects.size() + cold.size();
+			}
+
+			/// <summary>
+			/// Delete all the objects on the shelf
+			/// </summary>
+			void freeObjects()
+			{
+				objects.deleteObjects();
+				cold.deleteObjects();
+			}
+
+			/// <summary>
+			/// Record that a get() came up empty
+			/// </summary>
+			void miss()
+			{
+				auto now = std::chrono::steady_clock::now();
+				demand = decayedDemand(now) + 1.0;
+				demandAt = now;
+			}
+
+			/// <summary>
+			/// How much would the bucket benefit from one more clean object?
+			/// Recent misses raise the need, objects already on the shelf lower it
+			/// </summary>
+			double need(std::chrono::steady_clock::time_point now) const
+			{
+				return (1.0 + decayedDemand(now)) / (1.0 + idle());
+			}
+
+		private:
+			double decayedDemand(std::chrono::steady_clock::time_point now) const
+			{
+				std::chrono::duration<double> age = now - demandAt;
+				return demand * std::exp2(-age.count() / demandHalfLifeSeconds);
+			}
+
+			static constexpr double demandHalfLifeSeconds = 1.0;
+		};
+
+		/// <summary>
+		/// bucket_index maps initializer strings to buckets with open addressing,
+		/// probing a flat array of hashes and bucket pointers, so a lookup usually
+		/// compares a hash or two and one string
+		/// Buckets are allocated on their own so pointers to them stay put as the index grows
+		/// Guarded by m_bucketMutex
+		/// </summary>
+		class bucket_index
+		{
+			struct slot
+			{
+				size_t hash = 0;
+				bucket* b = nullptr;
+			};
+
+		public:
+			bucket_index() {}
+			bucket_index(const bucket_index&) = delete;
+			bucket_index& operator=(const bucket_index&) = delete;
+
+			~bucket_index()
+			{
+				for (slot& s : m_slots)
+					delete s.b;
+			}
+
+			size_t size() const { return m_count; }
+
+			/// <summary>
+			/// Would another bucket make the index grow?
+			/// </summary>
+			bool full() const { return (m_count + 1) * 4 > m_slots.size() * 3; }
+
+			template <class Probe>
+			bucket* find(const Probe& initializer, size_t hash, const KeyEqual& equal) const
+			{
+				if (m_slots.empty())
+					return nullptr;
+
+				size_t mask = m_slots.size() - 1;
+				for (size_t s = hash & mask; m_slots[s].b != nullptr; s = (s + 1) & mask)
+				{
+					if (m_slots[s].hash == hash && equal(m_slots[s].b->initializer, initializer))
+						return m_slots[s].b;
+				}
+				return nullptr;
+			}
+
+			/// <summary>
+			/// Add a bucket for an initializer that is not in the index yet
+			/// </summary>
+			bucket* insert(Key&& initializer, size_t hash)
+			{
+				if (full())
+					rebuild(1, [](const bucket&) { return false; });
+
+				bucket* b = new bucket();
+				b->initializer = std::move(initializer);
+				place(hash, b);
+				++m_count;
+				return b;
+			}
+
+			/// <summary>
+			/// Delete the buckets that can go, and size the index to the buckets that are left
+			/// </summary>
+			/// <returns>How many buckets were deleted</returns>
+			template <class Reclaimable>
+			size_t reclaim(Reclaimable reclaimable)
+			{
+				size_t before = m_count;
+				rebuild(0, reclaimable);
+				return before - m_count;
+			}
+
+			/// <summary>
+			/// Walks the buckets in the index, in no particular order
+			/// </summary>
+			class iterator
+			{
+			public:
+				iterator(slot* s, slot* end) : m_s(s), m_end(end) { skip(); }
+
+				bucket& operator*() const { return *m_s->b; }
+				iterator& operator++() { ++m_s; skip(); return *this; }
+				bool operator!=(const iterator& other) const { return m_s != other.m_s; }
+
+			private:
+				void skip()
+				{
+					while (m_s != m_end && m_s->b == nullptr)
+						++m_s;
+				}
+
+				slot* m_s;
+				slot* m_end;
+			};
+
+			iterator begin() { return iterator(m_slots.data(), m_slots.data() + m_slots.size()); }
+			iterator end() { return iterator(m_slots.data() + m_slots.size(), m_slots.data() + m_slots.size()); }
+
+		private:
+			/// <summary>
+			/// Put a bucket in the first open slot from where its hash lands
+			/// </summary>
+			void place(size_t hash, bucket* b)
+			{
+				size_t mask = m_slots.size() - 1;
+				size_t s = hash & mask;
+				while (m_slots[s].b != nullptr)
+					s = (s + 1) & mask;
+				m_slots[s].hash = hash;
+				m_slots[s].b = b;
+			}
+
+			/// <summary>
+			/// Delete the reclaimable buckets and lay out the rest in a new array,
+			/// at most half full once room is made for more buckets
+			/// </summary>
+			template <class Reclaimable>
+			void rebuild(size_t room, Reclaimable reclaimable)
+			{
+				std::vector<slot> old;
+				old.swap(m_slots);
+
+				m_count = 0;
+				for (slot& s : old)
+				{
+					if (s.b == nullptr)
+						continue;
+
+					if (reclaimable(*s.b))
+					{
+						delete s.b;
+						s.b = nullptr;
+					}
+					else
+						++m_count;
+				}
+
+				size_t capacity = 8;
+				while (capacity < (m_count + room) * 2)
+					capacity *= 2;
+				m_slots.resize(capacity);
+
+				for (slot& s : old)
+				{
+					if (s.b != nullptr)
+						place(s.hash, s.b);
+				}
+			}
+
+			std::vector<slot> m_slots; // power of two in size, so hashes can be masked to a slot
+			size_t m_count = 0;
+		};
+
+		/// <summary>
+		/// bucket_array holds one bucket per enumerated initializer, in slot order,
+		/// so finding a bucket is indexing an array
+		/// It never grows, so there is nothing to reclaim
+		/// </summary>
+		template <size_t N>
+		class bucket_array
+		{
+		public:
+			bucket_array()
+			{
+				for (size_t s = 0; s < N; ++s)
+					m_buckets[s].initializer = enumerated_keys<Key>::key(s);
+			}
+			bucket_array(const bucket_array&) = delete;
+			bucket_array& operator=(const bucket_array&) = delete;
+
+			size_t size() const { return N; }
+			bool full() const { return false; }
+
+			/// <summary>
+			/// The bucket for a slot, throwing std::out_of_range for keys past the enumeration,
+			/// like the count at the end of an enum or an integer cast to the enum
+			/// </summary>
+			bucket* at(size_t slot)
+			{
+				if (slot >= N)
+					throw std::out_of_range("initializer is not one of the enumerated keys");
+				return &m_buckets[slot];
+			}
+
+			template <class Reclaimable>
+			size_t reclaim(Reclaimable) { return 0; }
+
+			bucket* begin() { return m_buckets; }
+			bucket* end() { return m_buckets + N; }
+
+		private:
+			bucket m_buckets[N];
+		};
+
+		typedef std::conditional_t
+		<
+			enumerated_keys<Key>::enumerated,
+			bucket_array<enumerated_keys<Key>::count>,
+			bucket_index
+		> bucket_table;
+
+		/// <summary>
+		/// Get an object for a given initializer string
+		/// Objects are created using initializer strings, used, then put() and clean()'d
+		/// and handed back out
+		/// </summary>
+		/// <param name="initializer">Initalizer for the object to return</param>
+		/// <returns>Pointer to a new or reused object</returns>
+		template <class Probe>
+		T* get(const Probe& initializer)
+		{
+			bucket* b = nullptr;
+			bool missed = false;
+			bool repurposed = false;
+			bool hedged = false;
+			bool constructing = false;
+			while (m_keepRunning)
+			{
+				T* ret_val = nullptr;
+				bool hibernating = false;
+				{
+					std::unique_lock<std::mutex> lock(m_bucketMutex);
+
+					b = bucketFor(initializer);
+					if (!b->objects.empty())
+					{
+						ret_val = b->objects.pop_back();
+					}
+					else if (!b->cold.empty()) // a hibernating object is still cheaper than constructing one
+					{
+						ret_val = b->cold.pop_back();
+						hibernating = true;
+					}
+					else
+					{
+						// Note the miss so background cleaning favors this bucket
+						if (!missed)
+						{
+							b->miss();
+							missed = true;
+						}
+
+						size_t maxConstructing = m_maxConstructing.load();
+						bool roomToConstruct = maxConstructing == 0 || b->constructing < maxConstructing;
+
+						// Rebind another bucket's idle object, if it can spare one
+						// Rebinding stands in for constructing, so it takes a construction slot and a turn
+						// under the rate limit, and it waits out a tripped circuit breaker like the constructor
+						if (!repurposed && m_reinitialize.load() && roomToConstruct && !b->tripped(m_failureThreshold.load()))
+						{
+							repurposed = true;
+							bucket* donor = surplusBucket(b);
+							if (donor != nullptr)
+							{
+								bool wasHibernating = !donor->cold.empty();
+								T* t = takeOldest(donor);
+								size_t generation = b->generation.load();
+								++b->constructing; // also keeps the bucket around while the object is rebound
+								lock.unlock();
+								takeConstructionTurn(true);
+								bool rebound = (!wasHibernating || wake(t)) && rebind(t, b, generation);
+								lock.lock();
+								--b->constructing;
+								if (b->waiting > 0)
+									b->available.notify_one();
+								if (rebound)
+									return t;
+								continue;
+							}
+						}
+
+						// If an object is likely to be put back before one could be constructed,
+						// construct one in the background and take whichever shows up first
+						// The background construction takes one of the bucket's construction slots
+						if (!hedged && roomToConstruct && shouldHedge(b))
+						{
+							hedged = true;
+							m_hedges.fetch_add(1);
+							++b->constructing;
+							++b->waiting;
+							lock.unlock();
+							replace(b, true);
+							lock.lock();
+
+							auto deadline =
+								std::chrono::steady_clock::now()
+								+
+								std::chrono::duration_cast<std::chrono::steady_clock::duration>
+								(
+									std::chrono::duration<double>(2.0 * b->constructSeconds)
+								);
+							b->available.wait_until(lock, deadline, [&] { return b->idle() > 0 || !m_keepRunning; });
+							--b->waiting;
+							continue;
+						}
+
+						// Construct if there's room, otherwise wait for an object or a construction slot
+						if (roomToConstruct)
+						{
+							++b->constructing;
+							constructing = true;
+							break;
+						}
+
+						++b->waiting;
+						b->available.wait
+						(
+							lock,
+							[&]
+							{
+								return
+									b->idle() > 0
+									||
+									m_maxConstructing.load() == 0
+									||
+									b->constructing < m_maxConstructing.load()
+									||
+									!m_keepRunning;
+							}
+						);
+						--b->waiting;
+						continue;
+					}
+
+					unshelved(b, ret_val);
+					++ret_val->m_uses;
+				}
+
+				if (hibernating && !wake(ret_val))
+					continue;
+
+				// Hand out the object if it's any good, otherwise discard it and try again
+				if (isValid(ret_val))
+				{
+					lease(b);
+					return ret_val;
+				}
+
+				m_rejected.fetch_add(1);
+				retire({ ret_val });
+			}
+
+			// Failing all of that, including whether we should keep running,
+			// construct a new T object with the initializer
+			T* t = nullptr;
+			try
+			{
+				t = b != nullptr ? construct(b, b->initializer) : construct(b, Key(initializer));
+			}
+			catch (...)
+			{
+				if (constructing)
+					doneConstructing(b);
+				throw;
+			}
+			if (constructing)
+				doneConstructing(b);
+
+			if (t != nullptr)
+			{
+				t->m_uses = 1;
+				if (b != nullptr)
+					lease(b);
+			}
+			return t;
+		}
+
+		/// <summary>
+		/// Count an object handed out from a bucket, keeping track of the peak
+		/// </summary>
+		void lease(bucket* b)
+		{
+			size_t leased = ++b->leased;
+			size_t peak = b->peakLeased.load();
+			while (leased > peak && !b->peakLeased.compare_exchange_weak(peak, leased));
+		}
+
+		/// <summary>
+		/// Which other bucket can best spare an idle object?
+		/// Only a few buckets are sampled, see sampleStocked(), as this is on the miss path
+		/// Call with m_bucketMutex held
+		/// </summary>
+		/// <returns>The sampled bucket with the least need that has more than one idle object, or nullptr if none do</returns>
+		bucket* surplusBucket(bucket* needy)
+		{
+			auto now = std::chrono::steady_clock::now();
+			return
+				sampleStocked
+				(
+					[&](const bucket& b) { return &b != needy && b.idle() > 1; },
+					[&](const bucket& b) { return b.need(now); },
+					false
+				);
+		}
+
+		/// <summary>
+		/// Rebind an idle object to a bucket's initializer and hand it out
+		/// Objects that decline go back to their bucket, objects that throw are discarded
+		/// and count as a failure toward the bucket's circuit breaker, as rebinding stands in for constructing
+		/// </summary>
+		/// <param name="generation">The bucket's generation from before the object was rebound</param>
+		/// <returns>true if the object now belongs to the bucket and is checked out</returns>
+		bool rebind(T* t, bucket* b, size_t generation)
+		{
+			bool rebound = false;
+			try
+			{
+				rebound = t->reinitialize(b->initializer);
+			}
+			catch (...)
+			{
+				// A failure to rebind counts toward the bucket's circuit breaker, like a failure to construct
+				constructionFailed(b, std::current_exception());
+				m_rejected.fetch_add(1);
+				retire({ t });
+				return false;
+			}
+
+			if (!rebound)
+			{
+				shelve(t);
+				return false;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				--bucketOf(t)->refs;
+				++b->refs;
+				t->m_initializer = b->initializer;
+				t->m_bucket = b;
+				t->m_generation = generation;
+				t->m_validatedAt = std::chrono::steady_clock::now();
+				++t->m_uses;
+				lease(b);
+				b->failures = 0;
+				b->lastFailure = nullptr;
+			}
+			m_reinitialized.fetch_add(1);
+			return true;
+		}
+
+		/// <summary>
+		/// Should a miss wait for an object to be put back, with a construction in the background?
+		/// Only if objects are out, and they come back faster than objects get constructed
+		/// Call with m_bucketMutex held
+		/// </summary>
+		bool shouldHedge(bucket* b)
+		{
+			return
+				m_hedging.load()
+				&& b->leased.load() > 0
+				&& b->returnSeconds > 0.0
+				&& b->returnSeconds < b->constructSeconds;
+		}
+
+		/// <summary>
+		/// Free up a construction slot for a bucket and let a waiter have it
+		/// </summary>
+		void doneConstructing(bucket* b)
+		{
+			std::unique_lock<std::mutex> lock(m_bucketMutex);
+			--b->constructing;
+			if (b->waiting > 0)
+				b->available.notify_one();
+		}
+
+		/// <summary>
+		/// Take a turn to construct under the construction rate limit
+		/// </summary>
+		/// <param name="wait">Sleep until a turn comes up, otherwise only take a turn that is up now</param>
+		/// <returns>true if the turn was taken</returns>
+		bool takeConstructionTurn(bool wait)
+		{
+			double perSecond = m_constructionRate.load();
+			if (perSecond <= 0.0)
+				return true;
+
+			std::chrono::steady_clock::time_point at;
+			{
+				auto now = std::chrono::steady_clock::now();
+				std::unique_lock<std::mutex> lock(m_rateMutex);
+				if (!wait && m_nextConstructionAt > now)
+					return false;
+
+				at = std::max(now, m_nextConstructionAt);
+				m_nextConstructionAt =
+					at + std::chrono::duration_cast<std::chrono::steady_clock::duration>
+					(
+						std::chrono::duration<double>(1.0 / perSecond)
+					);
+			}
+			std::this_thread::sleep_until(at);
+			return true;
+		}
+
+		/// <summary>
+		/// Find or add the bucket for an initializer
+		/// Call with m_bucketMutex held
+		/// </summary>
+		template <class Probe>
+		bucket* bucketFor(const Probe& initializer)
+		{
+			// Enumerated initializers index straight into their array
+			if constexpr (enumerated_keys<Key>::enumerated)
+			{
+				return m_initBuckets.at(enumerated_keys<Key>::slot(initializer));
+			}
+			// Without transparent functors, lookups need a Key
+			else if constexpr (!std::is_same_v<Probe, Key> && !(is_transparent<Hash>::value && is_transparent<KeyEqual>::value))
+			{
+				return bucketFor(Key(initializer));
+			}
+			else
+			{
+				// Use the null bucket with the default initializer, like an empty string,
+				// otherwise find the bucket for the initializer
+				if (m_keyEqual(m_unBucket.initializer, initializer))
+					return &m_unBucket;
+
+				size_t hash = m_hash(initializer);
+				bucket* b = m_initBuckets.find(initializer, hash, m_keyEqual);
+				if (b != nullptr)
+					return b;
+
+				// Make room by letting go of the buckets nobody is using before growing the index
+				if (m_initBuckets.full() && m_keepRunning)
+					reclaimBuckets();
+				return m_initBuckets.insert(Key(initializer), hash);
+			}
+		}
+
+		/// <summary>
+		/// Delete the buckets that nothing is using, so the index stays proportional
+		/// to the initializers in use, not every initializer ever seen
+		/// Call with m_bucketMutex held
+		/// </summary>
+		void reclaimBuckets()
+		{
+			auto now = std::chrono::steady_clock::now();
+			size_t failureThreshold = m_failureThreshold.load();
+			m_initBuckets.reclaim
+			(
+				[&](const bucket& b)
+				{
+					if (!b.quiet(now, failureThreshold))
+						return false;
+
+					uncharge(b.prototypeBytes);
+					return true;
+				}
+			);
+		}
+
+		/// <summary>
+		/// Construct a new object for a bucket, keeping track of how long construction takes
+		/// </summary>
+		/// <param name="b">Bucket the object belongs to, nullptr if the pool is shutting down</param>
+		/// <param name="background">
+		/// Constructing in an executor job, which must not sleep on the rate limit,
+		/// so nothing is constructed if the rate limit says to wait
+		/// </param>
+		/// <returns>The new object, or nullptr if the constructor returned nullptr or a background construction was skipped</returns>
+		T* construct(bucket* b, const Key& initializer, bool background = false)
+		{
+			if (background && !takeConstructionTurn(false))
+				return nullptr;
+
+			if (b != nullptr)
+				checkCircuit(b);
+
+			if (!background)
+				takeConstructionTurn(true);
+
+			// Note the generation before constructing, so an invalidate() while the object
+			// is being made leaves it stale rather than passing it off as current
+			std::shared_ptr<const T> prototype;
+			bool prototyping = b != nullptr && m_prototyping.load();
+			size_t generation = 0;
+			if (b != nullptr)
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				generation = b->generation.load();
+				if (prototyping)
+					prototype = b->prototype;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			T* t = nullptr;
+			try
+			{
+				if (prototype)
+					t = static_cast<T*>(prototype->clone());
+				if (t == nullptr)
+					t = m_constructor(initializer);
+			}
+			catch (...)
+			{
+				if (b != nullptr)
+					constructionFailed(b, std::current_exception());
+				throw;
+			}
+
+			if (b != nullptr)
+			{
+				auto now = std::chrono::steady_clock::now();
+				std::chrono::duration<double> elapsed = now - start;
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				b->failures = 0;
+				b->lastFailure = nullptr;
+				b->probing = false;
+				if (t == nullptr)
+					return t;
+
+				b->constructSeconds =
+					b->constructSeconds == 0.0
+					? elapsed.count()
+					: b->constructSeconds * 0.8 + elapsed.count() * 0.2;
+
+				t->m_bucket = b;
+				t->m_generation = generation;
+				t->m_createdAt = now;
+				t->m_validatedAt = now;
+				++b->refs;
+			}
+
+			if (prototyping && !prototype && t != nullptr)
+				capturePrototype(b, t);
+			return t;
+		}
+
+		/// <summary>
+		/// Clone a freshly constructed object to be the bucket's prototype, if it does not have one yet
+		/// </summary>
+		void capturePrototype(bucket* b, const T* t)
+		{
+			std::shared_ptr<const T> prototype;
+			try
+			{
+				prototype.reset(static_cast<const T*>(t->clone()));
+			}
+			catch (...)
+			{
+				return;
+			}
+			if (!prototype)
+				return;
+
+			// The prototype is held onto like an idle object, so it counts against memory budgets
+			size_t footprint = prototype->footprint();
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				if (b->prototype || t->m_generation != b->generation.load() || !m_keepRunning)
+					return;
+
+				b->prototype.swap(prototype);
+				b->prototypeBytes = footprint;
+				if (footprint > 0)
+				{
+					m_bytes.fetch_add(footprint);
+					m_registry.charge(footprint);
+				}
+			}
+
+			if (footprint > 0)
+				enforceBudgets();
+		}
+
+		/// <summary>
+		/// Fail fast with the last constructor failure if the initializer has been failing
+		/// Once the backoff has passed, one caller at a time gets through to try the constructor
+		/// </summary>
+		void checkCircuit(bucket* b)
+		{
+			size_t failureThreshold = m_failureThreshold.load();
+			if (failureThreshold == 0)
+				return;
+
+			std::unique_lock<std::mutex> lock(m_bucketMutex);
+			if (!b->tripped(failureThreshold) || b->lastFailure == nullptr)
+				return;
+
+			if (std::chrono::steady_clock::now() >= b->failFastUntil && !b->probing)
+			{
+				b->probing = true;
+				return;
+			}
+
+			std::exception_ptr lastFailure = b->lastFailure;
+			lock.unlock();
+			m_fastFails.fetch_add(1);
+			std::rethrow_exception(lastFailure);
+		}
+
+		/// <summary>
+		/// Count a constructor failure, and start failing fast if there have been too many
+		/// </summary>
+		void constructionFailed(bucket* b, std::exception_ptr failure)
+		{
+			std::unique_lock<std::mutex> lock(m_bucketMutex);
+			++b->failures;
+			b->lastFailure = failure;
+			b->probing = false;
+
+			if (b->tripped(m_failureThreshold.load()))
+				b->failFastUntil = std::chrono::steady_clock::now() + m_failureBackoff.load();
+		}
+
+		/// <summary>
+		/// Hand an object back to the pool for reuse
+		/// </summary>
+		void put(T* t)
+		{
+			if (t == nullptr)
+				return;
+
+			if (t->m_bucket != nullptr)
+				--bucketOf(t)->leased;
+
+			if (m_keepRunning)
+			{
+				if (isStale(t)) // invalidated while it was out, destroy it in the background
+				{
+					retire({ t });
+					return;
+				}
+
+				if (isWornOut(t, std::chrono::steady_clock::now())) // too old or used too much, swap it for a new one
+				{
+					m_wornOut.fetch_add(1);
+					replace(bucketOf(t));
+					retire({ t });
+					return;
+				}
+
+				if (t->needsClean() && t->cleanInBackground()) // queue up the object for background cleaning
+				{
+					if (enqueue(t))
+						return;
+
+					// The cleaning queue is full, so clean it here or drop it
+					if (m_overflowPolicy != overflow::clean_inline)
+					{
+						m_cleanQueueDrops.fetch_add(1);
+						destroy(t);
+						return;
+					}
+				}
+
+				// Clean up if it needs it and directly add to the right bucket
+				if (!t->needsClean() || clean(t))
+					shelve(t);
+				return;
+			}
+
+			// Failing all of that, including whether we should keep running, drop the object (delete)
+			destroy(t);
+		}
+
+		/// <summary>
+		/// Queue up an object for background cleaning
+		/// With the block overflow policy, wait a bit for room in the queue
+		/// </summary>
+		/// <returns>true if the object was queued, false if the queue is full</returns>
+		bool enqueue(T* t)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				if (m_incomingCount >= m_maxToClean && m_overflowPolicy == overflow::block)
+				{
+					m_incomingRoomCondition.wait_for
+					(
+						lock,
+						10ms,
+						[&] { return m_incomingCount < m_maxToClean || !m_keepRunning; }
+					);
+				}
+				if (m_incomingCount >= m_maxToClean || !m_keepRunning)
+				{
+					// Count the objects turned away toward the peak, so the peak tracks demand
+					// and not the limit, and the limit can grow back after a burst
+					if (m_keepRunning)
+						m_peakIncoming = std::max(m_peakIncoming, m_incomingCount + ++m_refusedIncoming);
+					return false;
+				}
+
+				bucket* b = bucketOf(t);
+				if (b->incoming.empty())
+					m_pendingBuckets.push_back(b);
+				b->incoming.push_back(t);
+				++m_incomingCount;
+				m_peakIncoming = std::max(m_peakIncoming, m_incomingCount);
+				++m_jobs;
+			}
+			m_executor.post([this]() { cleanOne(); });
+			return true;
+		}
+
+		/// <summary>
+		/// Executor job for cleaning up an object in the background
+		/// </summary>
+		void cleanOne()
+		{
+			// Get something to clean
+			T* t = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				if (m_keepRunning && m_incomingCount > 0)
+				{
+					// Clean for the bucket that needs it most, not just whatever came in last
+					size_t neediest = neediestPendingBucket();
+					bucket* b = m_pendingBuckets[neediest];
+					t = b->incoming.pop_back();
+					--m_incomingCount;
+					if (b->incoming.empty())
+					{
+						m_pendingBuckets[neediest] = m_pendingBuckets.back();
+						m_pendingBuckets.pop_back();
+					}
+					m_incomingRoomCondition.notify_one();
+				}
+			}
+
+			if (t != nullptr)
+			{
+				// Delete the object if it has been invalidated,
+				// otherwise clean it and add the object to the right pool
+				if (isStale(t))
+					destroy(t);
+				else if (clean(t))
+					shelve(t);
+			}
+
+			finishJob();
+		}
+
+		/// <summary>
+		/// Note that a job posted to the executor is done, waking up drain() and the destructor
+		/// The pool may be destroyed as soon as this returns
+		/// </summary>
+		void finishJob()
+		{
+			std::unique_lock<std::mutex> lock(m_incomingMutex);
+			if (--m_jobs == 0)
+				m_jobsCondition.notify_all();
+		}
+
+		/// <summary>
+		/// Return an object to a reusable state and reset its dirty flag
+		/// Objects that fail to clean are discarded in the background
+		/// </summary>
+		/// <returns>true if the object is clean and ready to shelve</returns>
+		bool clean(T* t)
+		{
+			try
+			{
+				t->clean();
+			}
+			catch (...)
+			{
+				m_rejected.fetch_add(1);
+				retire({ t });
+				return false;
+			}
+			t->m_dirty = false;
+			return true;
+		}
+
+		/// <summary>
+		/// Shrink an idle object down for the cold tier
+		/// Objects that fail to hibernate are discarded in the background
+		/// </summary>
+		/// <returns>true if the object is hibernating and ready to shelve</returns>
+		bool hibernate(T* t)
+		{
+			try
+			{
+				t->hibernate();
+			}
+			catch (...)
+			{
+				m_rejected.fetch_add(1);
+				retire({ t });
+				return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Bring a hibernated object back as it comes off the shelf
+		/// Objects that fail to wake are discarded in the background
+		/// </summary>
+		/// <returns>true if the object is awake and ready to hand out</returns>
+		bool wake(T* t)
+		{
+			try
+			{
+				t->wake();
+			}
+			catch (...)
+			{
+				m_rejected.fetch_add(1);
+				retire({ t });
+				return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Is the object good to hand out?
+		/// Objects are validated if they have gone the validation interval since their last check
+		/// </summary>
+		bool isValid(T* t)
+		{
+			auto interval = m_validateInterval.load();
+			if (interval == 0ms)
+				return true;
+
+			auto now = std::chrono::steady_clock::now();
+			if (now - t->m_validatedAt < interval)
+				return true;
+
+			bool valid = false;
+			try
+			{
+				valid = t->validate();
+			}
+			catch (...) {}
+
+			if (valid)
+				t->m_validatedAt = now;
+			return valid;
+		}
+
+		/// <summary>
+		/// Which of the buckets with objects waiting on cleaning has the most need?
+		/// With many buckets pending, only a few are considered, starting where the last look left off,
+		/// so each clean costs the same no matter how many initializers are in play
+		/// Call with m_incomingMutex held
+		/// </summary>
+		/// <returns>Index into m_pendingBuckets</returns>
+		size_t neediestPendingBucket()
+		{
+			size_t pending = m_pendingBuckets.size();
+			if (pending == 1)
+				return 0;
+
+			size_t sampled = std::min(pending, pendingBucketsSampled);
+			size_t start = m_pendingCursor % pending;
+			m_pendingCursor = start + sampled;
+
+			auto now = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(m_bucketMutex);
+			size_t neediest = start;
+			double mostNeed = -1.0;
+			for (size_t i = 0; i < sampled; ++i)
+			{
+				size_t b = (start + i) % pending;
+				double need = m_pendingBuckets[b]->need(now);
+				if (need > mostNeed)
+				{
+					mostNeed = need;
+					neediest = b;
+				}
+			}
+			return neediest;
+		}
+
+		/// <summary>
+		/// What bucket does an object belong in?
+		/// </summary>
+		bucket* bucketOf(T* t)
+		{
+			return static_cast<bucket*>(t->m_bucket);
+		}
+
+		/// <summary>
+		/// Has the object's bucket been invalidated since the object was made?
+		/// </summary>
+		bool isStale(T* t)
+		{
+			return t->m_generation != bucketOf(t)->generation.load();
+		}
+
+		/// <summary>
+		/// Has the object been around too long or handed out too many times?
+		/// </summary>
+		bool isWornOut(T* t, std::chrono::steady_clock::time_point now)
+		{
+			size_t maxUses = m_maxUses.load();
+			auto maxAge = m_maxAge.load();
+			return
+				(maxUses > 0 && t->m_uses >= maxUses)
+				||
+				(maxAge > 0ms && now - t->m_createdAt >= maxAge);
+		}
+
+		/// <summary>
+		/// Construct an object for a bucket in the background and shelve it,
+		/// to take the place of a worn out one or to hedge a miss
+		/// If the construction rate limit leaves no room, the bucket goes without
+		/// Call while something is keeping the bucket from being reclaimed, like one of its objects
+		/// </summary>
+		/// <param name="slotTaken">The caller took a construction slot for this, to be freed when the construction is done</param>
+		void replace(bucket* b, bool slotTaken = false)
+		{
+			bool running = false;
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				running = m_keepRunning;
+				if (running)
+					++m_jobs;
+			}
+			if (!running)
+			{
+				if (slotTaken)
+					doneConstructing(b);
+				return;
+			}
+
+			++b->refs; // hold onto the bucket until the job is done with it
+			m_executor.post
+			(
+				[this, b, slotTaken]()
+				{
+					try
+					{
+						T* t = construct(b, b->initializer, true);
+						if (t != nullptr)
+							shelve(t);
+					}
+					catch (...) {} // the bucket is one short, get() will construct as needed
+					if (slotTaken)
+						doneConstructing(b);
+					--b->refs;
+					finishJob();
+				}
+			);
+		}
+
+		/// <summary>
+		/// Delete an object, letting go of its bucket
+		/// </summary>
+		void destroy(T* t)
+		{
+			if (t->m_bucket != nullptr)
+				--bucketOf(t)->refs;
+			delete t;
+		}
+
+		/// <summary>
+		/// Hand objects to the executor for destruction in the background
+		/// </summary>
+		void retire(std::vector<T*>&& batch)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				++m_jobs;
+			}
+			m_executor.post
+			(
+				[this, batch = std::move(batch)]()
+				{
+					for (T* t : batch)
+						destroy(t);
+					finishJob();
+				}
+			);
+		}
+
+		/// <summary>
+		/// Hand a shelf of objects to the executor for destruction in the background,
+		/// without walking the shelf on this thread
+		/// </summary>
+		void retire(shelf& batch)
+		{
+			auto objects = std::make_shared<shelf>();
+			objects->splice(batch);
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				++m_jobs;
+			}
+			m_executor.post
+			(
+				[this, objects]()
+				{
+					while (!objects->empty())
+						destroy(objects->pop_front());
+					finishJob();
+				}
+			);
+		}
+
+		/// <summary>
+		/// Delete objects in jobs on the executor, 64 objects or more per job,
+		/// with the calling thread pitching in
+		/// Jobs still going at the deadline finish the object they are on and stop,
+		/// leaving the rest undeleted
+		/// </summary>
+		/// <param name="deadline">When to give up, nullptr to delete everything</param>
+		/// <returns>true if every object was deleted</returns>
+		bool deleteAll(std::vector<T*>&& objects, const std::chrono::steady_clock::time_point* deadline)
+		{
+			if (objects.empty())
+				return true;
+
+			// Shared with the jobs, which can outlast this call
+			struct deletion
+			{
+				std::vector<T*> objects;
+				std::atomic<size_t> next = 0;
+				std::atomic<size_t> deleted = 0;
+				std::mutex mutex;
+				std::condition_variable done;
+			};
+			auto state = std::make_shared<deletion>();
+			state->objects = std::move(objects);
+
+			auto end = deadline != nullptr ? *deadline : std::chrono::steady_clock::time_point::max();
+			auto work = [state, end]()
+			{
+				while (std::chrono::steady_clock::now() < end)
+				{
+					size_t o = state->next.fetch_add(1);
+					if (o >= state->objects.size())
+						break;
+
+					delete state->objects[o];
+					if (state->deleted.fetch_add(1) + 1 == state->objects.size())
+					{
+						std::unique_lock<std::mutex> lock(state->mutex);
+						state->done.notify_all();
+					}
+				}
+			};
+
+			size_t jobCount =
+				std::min
+				(
+					size_t(std::max(std::thread::hardware_concurrency(), 1U)),
+					(state->objects.size() + 63) / 64
+				) - 1;
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				m_jobs += jobCount;
+			}
+			for (size_t j = 0; j < jobCount; ++j)
+			{
+				m_executor.post
+				(
+					[this, work]()
+					{
+						work();
+						finishJob();
+					}
 				);
 			}
-			m_cleanupThread.join();
+			work();
+
+			std::unique_lock<std::mutex> lock(state->mutex);
+			auto finished = [&] { return state->deleted.load() == state->objects.size(); };
+			if (deadline != nullptr)
+				return state->done.wait_until(lock, *deadline, finished);
+			state->done.wait(lock, finished);
+			return true;
+		}
 
-			// Free memory in the object buckets
+		/// <summary>
+		/// Add a clean object to the bucket for its initializer
+		/// Objects invalidated since they were queued up for cleaning are retired instead
+		/// If the shelves are full, an object that is cheaper to construct, from a sample
+		/// of the buckets, is discarded to make room, and if there are none the object is dropped (deleted)
+		/// </summary>
+		/// <param name="hibernated">Put the object in the cold tier</param>
+		void shelve(T* t, bool hibernated = false)
+		{
+			size_t footprint = t->footprint();
+			T* victim = nullptr;
 			{
 				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				if (isStale(t))
+				{
+					lock.unlock();
+					retire({ t });
+					return;
+				}
+
+				bucket* b = bucketOf(t);
+				if (m_size.load() >= m_maxInventory)
+				{
+					bucket* cheapest = cheapestBucket(false);
+					if (cheapest == nullptr || cheapest->constructSeconds >= b->constructSeconds)
+					{
+						lock.unlock();
+						m_inventoryDrops.fetch_add(1);
+						destroy(t);
+						return;
+					}
+
+					victim = takeOldest(cheapest);
+				}
 
-				for (T* t : m_unBucket)
-					delete t;
+				(hibernated ? b->cold : b->objects).push_back(t);
+				stockChanged(b);
+				if (b->waiting > 0)
+					b->available.notify_one();
 
-				for (const auto& initIt : m_initBuckets)
+				auto now = std::chrono::steady_clock::now();
+				if (!hibernated)
 				{
-					for (T* t : initIt.second)
-						delete t;
+					if (b->returnedAt != std::chrono::steady_clock::time_point())
+					{
+						std::chrono::duration<double> interval = now - b->returnedAt;
+						b->returnSeconds =
+							b->returnSeconds == 0.0
+							? interval.count()
+							: b->returnSeconds * 0.8 + interval.count() * 0.2;
+					}
+					b->returnedAt = now;
+				}
+				t->m_shelvedAt = now;
+				t->m_footprint = footprint;
+				b->bytes += footprint;
+				m_size.fetch_add(1);
+				if (footprint > 0)
+				{
+					m_bytes.fetch_add(footprint);
+					m_registry.charge(footprint);
 				}
 			}
 
-			// Free memory in the incoming list
+			if (victim != nullptr)
 			{
-				std::unique_lock<std::mutex> lock(m_incomingMutex);
-				for (T* t : m_incoming)
-					delete t;
+				m_inventoryDrops.fetch_add(1);
+				retire({ victim });
 			}
+
+			if (footprint > 0)
+				enforceBudgets();
 		}
 
 		/// <summary>
-		/// Get a reuse object to get an object from the pool
-		/// and automatically return it back to the pool
+		/// Take the object that has been idle longest off of a bucket's shelf,
+		/// going for hibernating objects first unless asked for hot ones
+		/// Call with m_bucketMutex held
 		/// </summary>
-		/// <param name="initializer">Initializer for the object to return</param>
-		/// <returns>
-		/// An object for gaining access to a pooled object
-		/// </returns>
-		auto use(const std::wstring& initializer = L"")
+		/// <param name="hotFirst">Go for objects that are not hibernating first, like when freeing bytes</param>
+		T* takeOldest(bucket* b, bool hotFirst = false)
 		{
-			return reuse<T>(*this, initializer);
+			bool cold = hotFirst ? b->objects.empty() : !b->cold.empty();
+			T* t = (cold ? b->cold : b->objects).pop_front();
+			unshelved(b, t);
+			return t;
 		}
 
-	private:
 		/// <summary>
-		/// Get an object for a given initializer string
-		/// Objects are created using initializer strings, used, then put() and clean()'d
-		/// and handed back out
+		/// Account for an object taken off of a bucket's shelf
+		/// Call with m_bucketMutex held
 		/// </summary>
-		/// <param name="initializer">Initalizer for the object to return</param>
-		/// <returns>Pointer to a new or reused object</returns>
-		T* get(const std::wstring& initializer)
+		void unshelved(bucket* b, T* t)
 		{
-			if (m_keepRunning)
+			m_size.fetch_add(-1);
+			b->bytes -= t->m_footprint;
+			uncharge(t->m_footprint);
+			stockChanged(b);
+		}
+
+		/// <summary>
+		/// Keep the list of buckets with idle objects in step with the bucket's shelves
+		/// Call with m_bucketMutex held, after objects go on or come off of the bucket's shelves
+		/// </summary>
+		void stockChanged(bucket* b)
+		{
+			if (b->idle() > 0 && !b->stocked)
 			{
-				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				b->stocked = true;
+				b->stockedPrev = nullptr;
+				b->stockedNext = m_stockedFront;
+				if (m_stockedFront != nullptr)
+					m_stockedFront->stockedPrev = b;
+				m_stockedFront = b;
+				++m_stockedCount;
+			}
+			else if (b->idle() == 0 && b->stocked)
+			{
+				if (m_stockedCursor == b)
+					m_stockedCursor = b->stockedNext;
+				if (b->stockedPrev != nullptr)
+					b->stockedPrev->stockedNext = b->stockedNext;
+				else
+					m_stockedFront = b->stockedNext;
+				if (b->stockedNext != nullptr)
+					b->stockedNext->stockedPrev = b->stockedPrev;
+				b->stocked = false;
+				b->stockedPrev = nullptr;
+				b->stockedNext = nullptr;
+				--m_stockedCount;
+			}
+		}
+
+		/// <summary>
+		/// Which of the buckets with idle objects would miss one the least?
+		/// Only a few buckets are considered, starting where the last look left off,
+		/// so each look costs the same no matter how many initializers are in play
+		/// Call with m_bucketMutex held
+		/// </summary>
+		/// <param name="eligible">Can the bucket give up an object?</param>
+		/// <param name="cost">How much would the bucket miss an object?</param>
+		/// <param name="keepLooking">Look past the first few buckets if none of them are eligible</param>
+		/// <returns>The least costly eligible bucket considered, or nullptr if none were</returns>
+		template <class Eligible, class Cost>
+		bucket* sampleStocked(Eligible eligible, Cost cost, bool keepLooking)
+		{
+			if (m_stockedCount == 0)
+				return nullptr;
 
-				// Consider using the null bucket used with empty initializer strings
-				if (initializer.empty()) 
+			bucket* b = m_stockedCursor != nullptr ? m_stockedCursor : m_stockedFront;
+			bucket* ret_val = nullptr;
+			double leastCost = 0.0;
+			size_t considered = 0;
+			auto lookFurther = [&]
+			{
+				return considered < stockedBucketsSampled || (keepLooking && ret_val == nullptr);
+			};
+			for (; considered < m_stockedCount && lookFurther(); ++considered)
+			{
+				if (eligible(*b))
 				{
-					if (!m_unBucket.empty())
+					double c = cost(*b);
+					if (ret_val == nullptr || c < leastCost)
 					{
-						T* ret_val = m_unBucket.back();
-						m_unBucket.pop_back();
-						m_size.fetch_add(-1);
-						return ret_val;
-					}
-				}
-				else // we're using initializer strings
-				{
-					// Find the bucket for the initializer string
-					// See if a matching bucket exists and has objects to hand out
-					const auto& it = m_initBuckets.find(initializer);
-					if (it != m_initBuckets.end() && !it->second.empty())
-					{ 
-						T* ret_val = it->second.back();
-						it->second.pop_back();
-						m_size.fetch_add(-1);
-						return ret_val;
+						ret_val = b;
+						leastCost = c;
 					}
 				}
+				b = b->stockedNext != nullptr ? b->stockedNext : m_stockedFront;
 			}
+			m_stockedCursor = b;
+			return ret_val;
+		}
 
-			// Failing all of that, including whether we should keep running,
-			// construct a new T object with the initializer
-			return m_constructor(initializer);
+		/// <summary>
+		/// Take bytes off of this pool's and the process's books
+		/// </summary>
+		void uncharge(size_t bytes)
+		{
+			if (bytes > 0)
+			{
+				m_bytes.fetch_sub(bytes);
+				m_registry.credit(bytes);
+			}
 		}
 
 		/// <summary>
-		/// Hand an object back to the pool for reuse
+		/// Which bucket with objects on its shelf is the cheapest to restock?
+		/// A few buckets are sampled, see sampleStocked(), so this is the cheapest of those
+		/// Call with m_bucketMutex held
 		/// </summary>
-		void put(T* t)
+		/// <param name="perByte">Rank by construction time per byte held rather than just construction time</param>
+		/// <returns>The bucket, or nullptr if no bucket has objects to give up</returns>
+		bucket* cheapestBucket(bool perByte)
 		{
-			if (t == nullptr)
-				return;
+			return
+				sampleStocked
+				(
+					[&](const bucket& b) { return !perByte || b.bytes > 0; },
+					[&](const bucket& b) { return perByte ? b.constructSeconds * b.idle() / b.bytes : b.constructSeconds; },
+					true
+				);
+		}
 
-			if (m_keepRunning)
+		/// <summary>
+		/// Executor job for retiring objects that have lived too long,
+		/// and hibernating objects that have been idle too long and moving them to the cold tier
+		/// </summary>
+		void sweep()
+		{
+			auto hibernateAfter = m_hibernateAfter.load();
+			bool checkAge = m_maxAge.load() > 0ms;
+
+			shelf wornOut;
+			std::vector<bucket*> toReplace;
+			shelf sleepy;
+			size_t quiet = 0;
+			size_t failureThreshold = m_failureThreshold.load();
 			{
-				if (t->cleanInBackground()) // queue up the object for background cleaning
+				auto now = std::chrono::steady_clock::now();
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				auto collect = [&](bucket& b)
 				{
-					std::unique_lock<std::mutex> lock(m_incomingMutex);
-					if (m_incoming.size() < m_maxToClean)
+					if (b.quiet(now, failureThreshold))
+						++quiet;
+
+					// Take the objects that have lived too long off the shelves,
+					// checking a few objects per shelf each sweep so the lock is not held
+					// in proportion to the inventory
+					if (checkAge)
 					{
-						m_incoming.push_back(t);
-						m_incomingCondition.notify_one();
-						return;
+						for (shelf* s : { &b.objects, &b.cold })
+						{
+							T* t = s->cursor();
+							for (size_t checked = 0; t != nullptr && checked < ageChecksPerSweep; ++checked)
+							{
+								T* next = shelf::next(t);
+								if (isWornOut(t, now))
+								{
+									s->erase(t);
+									unshelved(&b, t);
+									wornOut.push_back(t);
+									toReplace.push_back(&b);
+								}
+								t = next;
+							}
+							s->setCursor(t);
+						}
 					}
-				}
-				else // clean up and directly add to the right bucket
-				{
-					t->clean();
 
-					if (m_size.load() < m_maxInventory)
+					// Take the objects idle too long off the shelves,
+					// objects go on the back of the shelf, so they are in order from the front
+					if (hibernateAfter > 0ms)
 					{
-						std::wstring initializer = t->initializer();
-						std::unique_lock<std::mutex> lock(m_bucketMutex);
-						if (initializer.empty())
-							m_unBucket.push_back(t);
-						else
-							m_initBuckets[initializer].push_back(t);
-						m_size.fetch_add(1);
-						return;
+						while (!b.objects.empty() && now - b.objects.front()->m_shelvedAt >= hibernateAfter)
+						{
+							T* t = b.objects.pop_front();
+							unshelved(&b, t);
+							sleepy.push_back(t);
+						}
 					}
-				}
+				};
+
+				collect(m_unBucket);
+				for (bucket& b : m_initBuckets)
+					collect(b);
+
+				// Let go of the buckets nobody is using, if they are taking up much of the index
+				if (m_keepRunning && quiet * 2 > m_initBuckets.size())
+					reclaimBuckets();
 			}
 
-			// Failing all of that, including whether we should keep running, drop the object (delete)
-			delete t;
+			// Swap out the old objects for new ones
+			if (!wornOut.empty())
+			{
+				m_wornOut.fetch_add(wornOut.size());
+				for (bucket* b : toReplace)
+					replace(b);
+				retire(wornOut);
+			}
+
+			// Hibernate them and put them back in the cold tier
+			while (!sleepy.empty())
+			{
+				T* t = sleepy.pop_front();
+				if (hibernate(t))
+					shelve(t, true);
+			}
 		}
 
 		/// <summary>
-		/// Thread routine for cleaning up objects in the background
+		/// If the sizing window is up, apply the recommended limits and start a new window
+		/// Run from the maintenance job, which is never run twice at once
 		/// </summary>
-		void cleanup()
+		void adaptSizing()
 		{
-			while (m_keepRunning)
+			auto window = m_sizingWindow.load();
+			auto now = std::chrono::steady_clock::now();
+			if (window == 0ms || m_sizingWindowStart == std::chrono::steady_clock::time_point())
 			{
-				// Get something to clean
-				T* t;
-				{
-					std::unique_lock<std::mutex> lock(m_incomingMutex);
-					m_incomingCondition.wait_for
-					(
-						lock,
-						10ms,
-						[&] { return !m_incoming.empty() || !m_keepRunning; }
-					);
-					if (m_incoming.empty() || !m_keepRunning)
-						continue;
-
-					t = m_incoming.back();
-					m_incoming.pop_back();
-				}
+				m_sizingWindowStart = window == 0ms ? std::chrono::steady_clock::time_point() : now;
+				return;
+			}
+			if (now - m_sizingWindowStart < window)
+				return;
+			m_sizingWindowStart = now;
 
-				// Delete the object if our shelves are full
-				if (m_size.load() >= m_maxInventory)
+			pool_sizing sizing = recommendedSizing();
+			{
+				std::unique_lock<std::mutex> lock(m_bucketMutex);
+				auto roll = [](bucket& b)
 				{
-					delete t;
-					continue;
-				}
-
-				// Clean it
-				t->clean();
+					b.previousPeakLeased = b.peakLeased.load();
+					b.peakLeased = b.leased.load();
+				};
+				roll(m_unBucket);
+				for (bucket& b : m_initBuckets)
+					roll(b);
+			}
+			{
+				std::unique_lock<std::mutex> lock(m_incomingMutex);
+				m_previousPeakIncoming = m_peakIncoming;
+				m_peakIncoming = m_incomingCount;
+				m_refusedIncoming = 0;
+				m_maxToClean = sizing.maxToClean;
+				m_incomingRoomCondition.notify_all();
+			}
+			m_maxInventory = sizing.maxInventory;
+			shrinkInventory();
+		}
 
-				// Add the object to the right pool
-				std::wstring initializer = t->initializer();
+		/// <summary>
+		/// Drop the cheapest idle objects until inventory is within maxInventory
+		/// </summary>
+		void shrinkInventory()
+		{
+			std::vector<T*> victims;
+			{
 				std::unique_lock<std::mutex> lock(m_bucketMutex);
-				if (initializer.empty())
-					m_unBucket.push_back(t);
-				else
-					m_initBuckets[initializer].push_back(t);
-				m_size.fetch_add(1);
+				while (m_size.load() > int(m_maxInventory.load()))
+				{
+					bucket* b = cheapestBucket(false);
+					if (b == nullptr)
+						break;
+					victims.push_back(takeOldest(b));
+				}
 			}
+			if (!victims.empty())
+			{
+				m_inventoryDrops.fetch_add(victims.size());
+				retire(std::move(victims));
+			}
+		}
+
+		/// <summary>
+		/// Trim idle objects if this pool or the process is over its memory budget
+		/// Call without holding any locks
+		/// </summary>
+		void enforceBudgets()
+		{
+			size_t maxBytes = m_maxBytes.load();
+			size_t bytes = m_bytes.load();
+			if (maxBytes > 0 && bytes > maxBytes)
+				trim(bytes - maxBytes);
 
-			// All done.
-			m_doneCleaning = true;
+			m_registry.enforce();
 		}
 
 	public:
@@ -295,8 +2949,9 @@ namespace reuse
 			/// When this reuse object goes out of scape, the T object is returned to the pool
 			/// </summary>
 			/// <param name="pool">pool to get objects from and put objects back</param>
-			/// <param name="initializer">string to initialize the object</param>
-			reuse(pool<T>& pool, const std::wstring& initializer = L"")
+			/// <param name="initializer">initializer for the object</param>
+			template <class Probe = Key>
+			reuse(pool<T, Key, Hash, KeyEqual>& pool, const Probe& initializer = Probe())
 				: m_pool(pool)
 			{
 				m_t = m_pool.get(initializer);
@@ -325,27 +2980,300 @@ namespace reuse
 			T& get() { return *m_t; }
 
 		private:
-			pool<T>& m_pool;
+			pool<T, Key, Hash, KeyEqual>& m_pool;
 			T* m_t;
 		};
 
 	private:
-		const std::function<T* (const std::wstring&)> m_constructor;
+		const std::function<T* (const Key&)> m_constructor;
+		const Hash m_hash = Hash();
+		const KeyEqual m_keyEqual = KeyEqual();
 
 		std::atomic<int> m_size;
 
-		const size_t m_maxInventory;
-		std::vector<T*> m_unBucket;
-		std::unordered_map<std::wstring, std::vector<T*>> m_initBuckets;
+		std::atomic<size_t> m_maxInventory;
+		bucket m_unBucket;
+		bucket_table m_initBuckets;
+		bucket* m_stockedFront = nullptr; // list of buckets with idle objects, guarded by m_bucketMutex
+		bucket* m_stockedCursor = nullptr; // where sampleStocked() looks next, guarded by m_bucketMutex
+		size_t m_stockedCount = 0;
+		static constexpr size_t stockedBucketsSampled = 8; // buckets with idle objects considered per look
 		std::mutex m_bucketMutex;
 
-		const size_t m_maxToClean;
-		std::vector<T*> m_incoming;
+		std::atomic<size_t> m_maxToClean;
+		size_t m_incomingCount = 0;
+		size_t m_peakIncoming = 0; // guarded by m_incomingMutex, like the previous window's peak
+		size_t m_previousPeakIncoming = 0;
+		size_t m_refusedIncoming = 0; // objects the full queue turned away this window, guarded by m_incomingMutex
+		std::vector<bucket*> m_pendingBuckets; // buckets with incoming objects
+		size_t m_pendingCursor = 0; // where neediestPendingBucket() looks next, guarded by m_incomingMutex
+		static constexpr size_t pendingBucketsSampled = 8; // pending buckets considered per clean
 		std::mutex m_incomingMutex;
-		std::condition_variable m_incomingCondition;
+		std::condition_variable m_incomingRoomCondition;
+		const overflow m_overflowPolicy;
+
+		std::atomic<size_t> m_cleanQueueDrops = 0;
+		std::atomic<size_t> m_inventoryDrops = 0;
+
+		std::atomic<size_t> m_bytes = 0;
+		std::atomic<size_t> m_maxBytes = 0;
+		std::atomic<size_t> m_budgetDrops = 0;
+		registry& m_registry;
+
+		std::atomic<std::chrono::milliseconds> m_hibernateAfter = 0ms;
+		std::atomic<bool> m_sweeping = false;
+
+		std::atomic<std::chrono::milliseconds> m_maxAge = 0ms;
+		static constexpr size_t ageChecksPerSweep = 64; // idle objects checked for age per shelf per sweep
+		std::atomic<size_t> m_maxUses = 0;
+		std::atomic<size_t> m_wornOut = 0;
+
+		std::atomic<std::chrono::milliseconds> m_validateInterval = 0ms;
+		std::atomic<size_t> m_rejected = 0;
+
+		std::atomic<size_t> m_maxConstructing = 0;
+		std::atomic<double> m_constructionRate = 0.0;
+		std::chrono::steady_clock::time_point m_nextConstructionAt;
+		std::mutex m_rateMutex;
+
+		std::atomic<bool> m_hedging = false;
+		std::atomic<size_t> m_hedges = 0;
+
+		std::atomic<bool> m_reinitialize = false;
+		std::atomic<size_t> m_reinitialized = 0;
+
+		std::atomic<bool> m_prototyping = false;
+
+		std::atomic<std::chrono::milliseconds> m_sizingWindow = 0ms;
+		std::atomic<double> m_sizingHeadroom = 0.25;
+		std::chrono::steady_clock::time_point m_sizingWindowStart; // only touched by the maintenance job
+
+		std::atomic<size_t> m_failureThreshold = 0;
+		std::atomic<std::chrono::milliseconds> m_failureBackoff = 0ms;
+		std::atomic<size_t> m_fastFails = 0;
+
+		std::atomic<bool> m_keepRunning;
+		executor& m_executor;
+		size_t m_jobs = 0; // jobs posted to the executor and not yet done, guarded by m_incomingMutex
+		std::condition_variable m_jobsCondition;
+	};
+
+	/// <summary>
+	/// Point-in-time counts for a realtime_pool
+	/// </summary>
+	struct realtime_stats
+	{
+		size_t capacity = 0; // objects made up front
+		size_t available = 0; // objects ready to hand out
+		size_t exhausted = 0; // get() calls that came back empty handed
+		size_t rejected = 0; // objects taken out of service because clean() failed
+	};
+
+	/// <summary>
+	/// realtime_pool hands out a fixed set of objects, all made up front,
+	/// for threads that cannot allocate or block, like market-data handlers
+	/// get() and put() are wait-free: get() tries each object's slot at most once,
+	/// and put() cleans the object and releases its slot
+	/// When every object is out, get() returns nullptr instead of constructing,
+	/// so callers get a hard bound on latency
+	/// clean() runs as objects are put back, whatever cleanInBackground() says,
+	/// and there is no validation, hibernation, or retirement
+	/// </summary>
+	template <class T>
+	class realtime_pool
+	{
+	public:
+		typedef typename T::key_type Key;
+
+		/// <summary>
+		/// Declare a pool and make all of its objects
+		/// </summary>
+		/// <param name="constructor">What function to call to create new objects</param>
+		/// <param name="capacity">How many objects to make</param>
+		/// <param name="initializer">The initializer to make every object with</param>
+		realtime_pool
+		(
+			const std::function<T* (const Key&)>& constructor,
+			size_t capacity,
+			const Key& initializer = Key()
+		)
+			: m_slots(new slot[capacity])
+			, m_capacity(capacity)
+		{
+			try
+			{
+				for (size_t s = 0; s < m_capacity; ++s)
+				{
+					T* t = constructor(initializer);
+					t->m_slot = s;
+					m_slots[s].t = t;
+				}
+			}
+			catch (...)
+			{
+				deleteObjects();
+				throw;
+			}
+		}
+		realtime_pool(const realtime_pool&) = delete;
+		realtime_pool& operator=(const realtime_pool&) = delete;
+
+		/// <summary>
+		/// Delete the objects
+		/// Every object handed out must be put back first
+		/// </summary>
+		~realtime_pool()
+		{
+			deleteObjects();
+		}
+
+		/// <summary>
+		/// Get an object from the pool, if one is free
+		/// Threads start looking in different places, so they rarely contend for a slot
+		/// </summary>
+		/// <returns>The object, or nullptr if every object is out</returns>
+		T* get()
+		{
+			if (m_capacity == 0)
+				return nullptr;
+
+			size_t s = m_nextSlot.fetch_add(1, std::memory_order_relaxed) % m_capacity;
+			for (size_t tries = 0; tries < m_capacity; ++tries)
+			{
+				slot& candidate = m_slots[s];
+				int expected = slot_free;
+				if (candidate.state.load(std::memory_order_relaxed) == slot_free
+					&& candidate.state.compare_exchange_strong(expected, slot_taken, std::memory_order_acquire))
+				{
+					return candidate.t;
+				}
+
+				if (++s == m_capacity)
+					s = 0;
+			}
+
+			m_exhausted.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		/// <summary>
+		/// Put an object back in the pool, cleaning it first
+		/// Objects that fail to clean stay out of service until the pool is destroyed,
+		/// as deleting them here could block
+		/// </summary>
+		/// <param name="t">Object from this pool's get(), or nullptr</param>
+		void put(T* t)
+		{
+			if (t == nullptr)
+				return;
+
+			int state = slot_free;
+			if (t->needsClean())
+			{
+				try
+				{
+					t->clean();
+					t->m_dirty = false;
+				}
+				catch (...)
+				{
+					state = slot_rejected;
+					m_rejected.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			m_slots[t->m_slot].state.store(state, std::memory_order_release);
+		}
+
+		/// <summary>
+		/// Get a snapshot of what the pool has on hand
+		/// </summary>
+		realtime_stats stats() const
+		{
+			realtime_stats ret_val;
+			ret_val.capacity = m_capacity;
+			for (size_t s = 0; s < m_capacity; ++s)
+			{
+				if (m_slots[s].state.load(std::memory_order_relaxed) == slot_free)
+					++ret_val.available;
+			}
+			ret_val.exhausted = m_exhausted.load(std::memory_order_relaxed);
+			ret_val.rejected = m_rejected.load(std::memory_order_relaxed);
+			return ret_val;
+		}
+
+		/// <summary>
+		/// reuse is a RAII class for managing the lifetime of access to a pooled object
+		/// Check it before using it, as it is empty when the pool is exhausted
+		/// </summary>
+		class reuse
+		{
+		public:
+			reuse(realtime_pool<T>& pool)
+				: m_pool(pool)
+			{
+				m_t = m_pool.get();
+			}
+
+			reuse(reuse&& other)
+				: m_pool(other.m_pool)
+				, m_t(other.m_t)
+			{
+				other.m_t = nullptr;
+			}
+
+			~reuse()
+			{
+				m_pool.put(m_t);
+			}
+
+			/// <summary>
+			/// Did we get an object?
+			/// </summary>
+			explicit operator bool() const { return m_t != nullptr; }
+
+			/// <summary>
+			/// Access the pooled object
+			/// </summary>
+			T& get() { return *m_t; }
+
+		private:
+			realtime_pool<T>& m_pool;
+			T* m_t;
+		};
+
+		/// <summary>
+		/// Get an object wrapped in a reuse that puts it back when it goes out of scope
+		/// </summary>
+		reuse use()
+		{
+			return reuse(*this);
+		}
+
+	private:
+		static constexpr int slot_free = 0;
+		static constexpr int slot_taken = 1;
+		static constexpr int slot_rejected = 2;
+
+		/// <summary>
+		/// Each object gets its own cache line, so threads working different slots
+		/// do not slow each other down
+		/// </summary>
+		struct alignas(64) slot
+		{
+			std::atomic<int> state = slot_free;
+			T* t = nullptr;
+		};
+
+		void deleteObjects()
+		{
+			for (size_t s = 0; s < m_capacity; ++s)
+				delete m_slots[s].t;
+		}
 
-		bool m_keepRunning;
-		std::thread m_cleanupThread;
-		bool m_doneCleaning;
+		std::unique_ptr<slot[]> m_slots;
+		const size_t m_capacity;
+		std::atomic<size_t> m_nextSlot = 0;
+		std::atomic<size_t> m_exhausted = 0;
+		std::atomic<size_t> m_rejected = 0;
 	};
 }